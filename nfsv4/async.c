@@ -0,0 +1,332 @@
+#include <nfs4_internal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// an asynchronous read, write or lock. reads and writes are split into
+// chunks and kept up to io_depth deep like segment, a lock is a single
+// prebuilt rpc. recovering a bad session means blocking for a reconnect,
+// so here it's just reported to the completion. the file is counted
+// in f->operations until it's done, so file_close waits for it
+typedef struct operation {
+    file f;
+    client c;
+    int op;
+    rpc (*start)(file, buffer, void *, u64, u32);
+    status (*complete)(rpc);
+    int chunksize;
+    void *data;
+    u64 offset;
+    u32 length;
+    u32 issued; // bytes handed out to chunks so far
+    vector unsent;
+    vector inflight;
+    status s;
+    boolean waiting; // on the client's list for a slot
+    boolean local; // keep the page cache and held writes in step
+    struct callback cb; // shared by all the rpcs, runs step
+    completion k;
+    void *a;
+} *operation;
+
+static void deallocate_chunk(rpc r)
+{
+    put_buffer(r->c, r->b);
+    put_buffer(r->c, r->result);
+    if (r->completions) put_buffer(r->c, r->completions);
+    deallocate_rpc(r);
+}
+
+static void deallocate_operation(operation o)
+{
+    client c = o->c;
+    put_buffer(c, o->unsent);
+    put_buffer(c, o->inflight);
+    o->f->operations--;
+    deallocate(c->operations, o, sizeof(struct operation));
+}
+
+static void finish(operation o)
+{
+    client c = o->c;
+    if (o->waiting) vector_remove(c->waiting, o);
+    // the caller can reuse the buffer once we return
+    if (o->op == OP_WRITE) {
+        status zs = zerocopy_wait(c);
+        if (is_ok(o->s)) o->s = zs;
+    }
+    // the same as readfile and writefile do after a segment
+    if (o->local && (o->op == OP_READ) && is_ok(o->s)) {
+        overlay_writes(o->f, o->data, o->offset, o->length);
+        cache_fill(o->f, o->data, o->offset, o->length);
+    }
+    if (o->local && (o->op == OP_WRITE)) {
+        // some of it may have been written
+        if (is_ok(o->s)) cache_update(o->f, o->data, o->offset, o->length);
+        else cache_invalidate(o->f);
+    }
+    // gone before the completion runs, which may close the file
+    completion k = o->k;
+    void *a = o->a;
+    status s = o->s;
+    deallocate_operation(o);
+    k(a, s);
+}
+
+// send as much as the slot table and io_depth allow. true if the
+// operation is finished
+static boolean issue(operation o)
+{
+    client c = o->c;
+    while (is_ok(o->s) && (vector_length(o->inflight) < c->io_depth) &&
+           (vector_length(o->unsent) || (o->issued < o->length))) {
+        if (!slot_available(c)) {
+            if (!o->waiting) vector_push(c->waiting, o);
+            o->waiting = true;
+            return false;
+        }
+        rpc r;
+        if (vector_length(o->unsent)) {
+            r = vector_pop(o->unsent);
+        } else {
+            u32 xfer = MIN(o->length - o->issued, o->chunksize);
+            r = o->start(o->f, get_buffer(c),
+                         o->data + o->issued, o->offset + o->issued, xfer);
+            o->issued += xfer;
+        }
+        r->result = get_buffer(c);
+        r->completions = get_buffer(c);
+        vector_push(r->completions, &o->cb);
+        status s = rpc_send(r);
+        if (!is_ok(s)) {
+            o->s = s;
+            deallocate_chunk(r);
+            break;
+        }
+        vector_push(o->inflight, r);
+    }
+    if (c->t->flush) c->t->flush(c);
+    return !vector_length(o->inflight);
+}
+
+// retire whichever chunks have replies, an rpc handled here is taken
+// off the completed list so client_process doesn't run it again
+static void step(void *a)
+{
+    operation o = a;
+    client c = o->c;
+    for (int i = 0; i < vector_length(o->inflight); ) {
+        rpc r = vector_get(o->inflight, i);
+        if (!r->complete) {
+            i++;
+            continue;
+        }
+        vector_remove(o->inflight, r);
+        vector_remove(c->completed, r);
+        boolean badsession;
+        status s = parse_reply(r, o->op, r->result, &badsession);
+        if (is_ok(s)) s = o->complete(r);
+        if (is_ok(o->s)) o->s = s;
+        deallocate_chunk(r);
+    }
+    if (issue(o)) finish(o);
+}
+
+static status submit(operation o)
+{
+    client c = o->c;
+    client_lock(c);
+    o->issued = 0;
+    o->s = STATUS_OK;
+    o->waiting = false;
+    o->inflight = get_buffer(c);
+    o->cb.f = step;
+    o->cb.a = o;
+    if (issue(o)) {
+        if (is_ok(o->s)) {
+            finish(o);
+            client_unlock(c);
+            return STATUS_OK;
+        }
+        status s = o->s;
+        while (vector_length(o->unsent)) deallocate_chunk(vector_pop(o->unsent));
+        deallocate_operation(o);
+        client_unlock(c);
+        return s;
+    }
+    client_unlock(c);
+    return STATUS_OK;
+}
+
+static operation allocate_operation(file f, int op, status (*complete)(rpc),
+                                    completion k, void *a)
+{
+    client c = f->c;
+    if (!c->operations) c->operations = allocate_freelist(c->h, sizeof(struct operation));
+    operation o = allocate(c->operations, sizeof(struct operation));
+    o->f = f;
+    o->c = c;
+    f->operations++;
+    o->op = op;
+    o->start = 0;
+    o->complete = complete;
+    o->length = 0;
+    o->local = false;
+    o->unsent = get_buffer(c);
+    o->k = k;
+    o->a = a;
+    return o;
+}
+
+static status chunked(file f, int op, rpc (*start)(file, buffer, void *, u64, u32),
+                      status (*complete)(rpc), int chunksize, boolean local,
+                      void *x, u64 offset, u32 length, completion k, void *a)
+{
+    operation o = allocate_operation(f, op, complete, k, a);
+    o->start = start;
+    o->chunksize = chunksize;
+    o->local = local;
+    o->data = x;
+    o->offset = offset;
+    o->length = length;
+    return submit(o);
+}
+
+// straight from the server, for readahead windows. read_uncached lays
+// the held writes over whatever it takes out of them
+status read_async(file f, void *dest, u64 offset, u32 length, completion k, void *a)
+{
+    return chunked(f, OP_READ, read_chunk, read_chunk_complete,
+                   f->c->maxresp, false, dest, offset, length, k, a);
+}
+
+status readfile_async(file f, void *dest, u64 offset, u32 length, completion k, void *a)
+{
+    client_lock(f->c);
+    if (cache_read(f, dest, offset, length)) {
+        client_unlock(f->c);
+        k(a, STATUS_OK);
+        return STATUS_OK;
+    }
+    status s = chunked(f, OP_READ, read_chunk, read_chunk_complete,
+                       f->c->maxresp, true, dest, offset, length, k, a);
+    client_unlock(f->c);
+    return s;
+}
+
+// always written through, anything held goes first so it can't land
+// on top of this later
+status writefile_async(file f, void *source, u64 offset, u32 length, completion k, void *a)
+{
+    client_lock(f->c);
+    readahead_drop(f);
+    status s = flush_writes(f);
+    if (is_ok(s))
+        s = chunked(f, OP_WRITE, write_chunk, write_chunk_complete,
+                    f->c->maxreq, true, source, offset, length, k, a);
+    client_unlock(f->c);
+    return s;
+}
+
+status lock_range_async(file f, u32 locktype, u64 offset, u64 length, completion k, void *a)
+{
+    client_lock(f->c);
+    operation o = allocate_operation(f, OP_LOCK, lock_complete, k, a);
+    vector_push(o->unsent, lock_rpc(f, get_buffer(f->c), locktype, offset, length));
+    status s = submit(o);
+    client_unlock(f->c);
+    return s;
+}
+
+status unlock_range_async(file f, u32 locktype, u64 offset, u64 length, completion k, void *a)
+{
+    client_lock(f->c);
+    operation o = allocate_operation(f, OP_LOCKU, unlock_complete, k, a);
+    vector_push(o->unsent, unlock_rpc(f, get_buffer(f->c), locktype, offset, length));
+    status s = submit(o);
+    client_unlock(f->c);
+    return s;
+}
+
+// completions for replies that were read by a synchronous call, or slots
+// freed up for waiting operations, wouldn't otherwise make the fd readable
+void client_wakeup(client c)
+{
+    u64 one = 1;
+    if (c->wakeup >= 0) write(c->wakeup, &one, sizeof(one));
+}
+
+int client_fd(client c)
+{
+    if (c->epoll < 0) {
+        c->epoll = epoll_create1(EPOLL_CLOEXEC);
+        c->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event e = {.events = EPOLLIN, .data.ptr = 0};
+        epoll_ctl(c->epoll, EPOLL_CTL_ADD, c->wakeup, &e);
+        connection n;
+        vector_foreach(n, c->connections) {
+            if (n->fd < 0) continue;
+            e.data.ptr = n;
+            epoll_ctl(c->epoll, EPOLL_CTL_ADD, n->fd, &e);
+        }
+    }
+    return c->epoll;
+}
+
+// reads every reply that's available without blocking, then runs the
+// completions and restarts operations that were waiting for a slot. a
+// reply that has only partly arrived is read to the end. everything
+// left is still on the socket afterwards, so the fd is level triggered
+status client_process(client c)
+{
+    status s = STATUS_OK;
+    u64 count;
+    if (c->wakeup >= 0) read(c->wakeup, &count, sizeof(count));
+    client_lock(c);
+    c->processing = true;
+    if (c->t->flush) s = c->t->flush(c);
+    // if another thread is reading, what it gets is run next time
+    if (!c->receiving) {
+        connection n;
+        c->receiving = true;
+        while (is_ok(s) && (n = ready(c, 0)))
+            s = read_reply(n);
+        c->receiving = false;
+        pthread_cond_broadcast(&c->received);
+    }
+    // the connection is in an unknown state, fail everything outstanding
+    if (!is_ok(s)) abort_pending(c);
+
+    while (vector_length(c->completed)) {
+        rpc r = vector_get(c->completed, 0);
+        vector_remove(c->completed, r);
+        int len = vector_length(r->completions);
+        callback k[len];
+        for (int i = 0; i < len; i++) k[i] = vector_get(r->completions, i);
+        for (int i = 0; i < len; i++) k[i]->f(k[i]->a);
+    }
+
+    int waiting = vector_length(c->waiting);
+    for (int i = 0; i < waiting; i++) {
+        operation o = vector_pop(c->waiting);
+        o->waiting = false;
+        if (issue(o)) finish(o);
+    }
+    c->processing = false;
+    client_unlock(c);
+    return s;
+}
+
+// the operations on a file refer to it until they're finished, so
+// file_close waits them out. if the connection fails on the way they
+// fail with it
+void drain_operations(file f)
+{
+    client c = f->c;
+    client_lock(c);
+    while (f->operations) {
+        client_process(c);
+        if (f->operations && vector_length(c->pending) && !is_ok(receive_reply(c)))
+            abort_pending(c);
+    }
+    client_unlock(c);
+}
@@ -23,6 +23,7 @@ static bytes length(buffer b)
 static buffer allocate_buffer(heap h, bytes capacity){
     buffer b = allocate(h, sizeof(struct buffer));
     memset(b, 0, sizeof(struct buffer));    
+    b->h = h;
     b->capacity = capacity;
     b->contents = allocate(h, b->capacity);
     return b;
@@ -35,7 +36,7 @@ static inline void buffer_extend(buffer b, bytes len)
         b->capacity = MAX(2 * oldcap, oldcap+len);
         void *new =  allocate(b->h, b->capacity);
 
-        memcpy(new, b->contents, length(b));        
+        memcpy(new, b->contents + b->start, length(b));        
         deallocate(b->h, b->contents, oldcap);
         b->end = b->end - b->start;
         b->start = 0;
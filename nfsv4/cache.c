@@ -0,0 +1,375 @@
+#include <nfs4_internal.h>
+#include <unistd.h>
+
+// pages of file contents keyed by filehandle and offset. while a file
+// holds a delegation nobody else can change it without a recall, so its
+// pages are used as they are. otherwise the change attribute is checked
+// at open and each time a lock is taken, close-to-open style, and the
+// pages are only used until a lock is released. NFS_CACHE_PAGES sets
+// the size, and zero (the default) turns the cache off. fetchfile hands
+// out pages themselves, and those stay put until unfetchfile even if
+// they're evicted or invalidated in the meantime. the data of a page is
+// aligned to the memory page for that
+
+typedef struct page {
+    struct page *next; // in the hash bucket
+    struct page *newer, *older;
+    u32 refs; // fetched and not yet released
+    boolean stale; // out of the cache, freed on the last release
+    u8 len;
+    u8 fh[NFS4_FHSIZE];
+    u64 offset;
+    u8 *data;
+} *page;
+
+// the change attribute the pages of a filehandle were checked against
+typedef struct cached_file {
+    u8 len;
+    u8 fh[NFS4_FHSIZE];
+    u64 change;
+} *cached_file;
+
+struct page_cache {
+    heap pages;
+    heap data; // the contents of pages
+    u32 pagesize;
+    u32 capacity, count;
+    u32 buckets;
+    page *table;
+    page newest, oldest;
+    vector files;
+    vector fetched; // pages with refs, for unfetchfile
+    u32 changes; // times pages were dropped or written, see fetchfile
+};
+
+void cache_init(client c)
+{
+    u32 capacity = config_u64("NFS_CACHE_PAGES", 0);
+    c->cache = 0;
+    if (!capacity) return;
+    struct page_cache *k = allocate(c->h, sizeof(struct page_cache));
+    k->pagesize = config_u64("NFS_CACHE_PAGE_SIZE", 4096);
+    k->pages = allocate_freelist(c->h, sizeof(struct page));
+    k->data = allocate_aligned(c->h, sysconf(_SC_PAGESIZE));
+    k->capacity = capacity;
+    k->count = 0;
+    k->buckets = capacity;
+    k->table = allocate(c->h, k->buckets * sizeof(page));
+    memset(k->table, 0, k->buckets * sizeof(page));
+    k->newest = k->oldest = 0;
+    k->files = allocate_vector(c->h, 8);
+    k->fetched = allocate_vector(c->h, 8);
+    k->changes = 0;
+    c->cache = k;
+}
+
+static boolean same_fh(file f, u8 len, u8 *fh)
+{
+    return (f->filehandle_len == len) && !memcmp(f->filehandle, fh, len);
+}
+
+static page *bucket(struct page_cache *k, u8 len, u8 *fh, u64 offset)
+{
+    // fnv-1a
+    u64 h = 14695981039346656037ull;
+    for (int i = 0; i < len; i++)
+        h = (h ^ fh[i]) * 1099511628211ull;
+    h = (h ^ (offset / k->pagesize)) * 1099511628211ull;
+    return k->table + (h % k->buckets);
+}
+
+static page find(struct page_cache *k, file f, u64 offset)
+{
+    for (page p = *bucket(k, f->filehandle_len, f->filehandle, offset); p; p = p->next)
+        if ((p->offset == offset) && same_fh(f, p->len, p->fh))
+            return p;
+    return 0;
+}
+
+static void unlink_lru(struct page_cache *k, page p)
+{
+    if (p->newer) p->newer->older = p->older;
+    else k->newest = p->older;
+    if (p->older) p->older->newer = p->newer;
+    else k->oldest = p->newer;
+}
+
+static void link_lru(struct page_cache *k, page p)
+{
+    p->older = k->newest;
+    p->newer = 0;
+    if (k->newest) k->newest->newer = p;
+    k->newest = p;
+    if (!k->oldest) k->oldest = p;
+}
+
+static page new_page(struct page_cache *k)
+{
+    page p = allocate(k->pages, sizeof(struct page));
+    p->data = allocate(k->data, k->pagesize);
+    p->refs = 0;
+    p->stale = false;
+    return p;
+}
+
+static void free_page(struct page_cache *k, page p)
+{
+    deallocate(k->data, p->data, k->pagesize);
+    deallocate(k->pages, p, sizeof(struct page));
+}
+
+static void remove_page(struct page_cache *k, page p)
+{
+    page *b;
+    for (b = bucket(k, p->len, p->fh, p->offset); *b != p; b = &(*b)->next);
+    *b = p->next;
+    unlink_lru(k, p);
+    k->count--;
+    if (p->refs) p->stale = true;
+    else free_page(k, p);
+}
+
+static void release(struct page_cache *k, page p)
+{
+    if (--p->refs) return;
+    vector_remove(k->fetched, p);
+    if (p->stale) free_page(k, p);
+}
+
+// a page that's already filled
+static void add_page(struct page_cache *k, file f, page p, u64 offset)
+{
+    if (k->count >= k->capacity) {
+        // fetched pages are skipped, if they're all out we go over
+        page v;
+        for (v = k->oldest; v && v->refs; v = v->newer);
+        if (v) remove_page(k, v);
+    }
+    p->len = f->filehandle_len;
+    memcpy(p->fh, f->filehandle, f->filehandle_len);
+    p->offset = offset;
+    page *b = bucket(k, f->filehandle_len, f->filehandle, offset);
+    p->next = *b;
+    *b = p;
+    link_lru(k, p);
+    k->count++;
+}
+
+// the caller fills it before letting go of the client lock
+static page insert(struct page_cache *k, file f, u64 offset)
+{
+    page p = find(k, f, offset);
+    if (p) {
+        unlink_lru(k, p);
+        link_lru(k, p);
+        return p;
+    }
+    p = new_page(k);
+    add_page(k, f, p, offset);
+    return p;
+}
+
+static boolean trusted(file f)
+{
+    client c = f->c;
+    if (!c->cache) return false;
+    if ((f->delegation_type != OPEN_DELEGATE_NONE) &&
+        (f->delegation_epoch == c->delegation_epoch))
+        return true;
+    return f->validated;
+}
+
+#define foreach_page(__k, __p, __offset, __length)\
+    for (u64 __p = (__offset) - ((__offset) % (__k)->pagesize); __p < (__offset) + (__length); __p += (__k)->pagesize)
+
+// true if the whole range was cached
+boolean cache_read(file f, void *dest, u64 offset, u32 length)
+{
+    struct page_cache *k = f->c->cache;
+    if (!trusted(f)) return false;
+    foreach_page(k, p, offset, length)
+        if (!find(k, f, p)) return false;
+    foreach_page(k, p, offset, length) {
+        page g = find(k, f, p);
+        u64 start = MAX(p, offset), end = MIN(p + k->pagesize, offset + length);
+        memcpy(dest + (start - offset), g->data + (start - p), end - start);
+        unlink_lru(k, g);
+        link_lru(k, g);
+    }
+    return true;
+}
+
+// xFetch. only ranges within one page, and only when the pages could
+// be read from, otherwise dest is zero and the caller should read
+status fetchfile(file f, u64 offset, u32 length, void **dest)
+{
+    struct page_cache *k = f->c->cache;
+    *dest = 0;
+    client_lock(f->c);
+    u64 base = k ? offset - (offset % k->pagesize) : 0;
+    if (!trusted(f) || (offset + length > base + k->pagesize)) {
+        client_unlock(f->c);
+        return STATUS_OK;
+    }
+    page g = find(k, f, base);
+    if (!g) {
+        // the client lock is let go while the read waits, so the page
+        // goes in only once it's filled, and not at all if pages were
+        // dropped or written meanwhile, since it may be from before that
+        u32 changes = k->changes;
+        page n = new_page(k);
+        status s = read_uncached(f, n->data, base, k->pagesize);
+        if (!is_ok(s) || (changes != k->changes) || !trusted(f)) {
+            free_page(k, n);
+            client_unlock(f->c);
+            return s;
+        }
+        // or someone else got it in first
+        if ((g = find(k, f, base))) free_page(k, n);
+        else add_page(k, f, g = n, base);
+    }
+    unlink_lru(k, g);
+    link_lru(k, g);
+    if (!g->refs++) vector_push(k->fetched, g);
+    *dest = g->data + (offset - base);
+    client_unlock(f->c);
+    return STATUS_OK;
+}
+
+void unfetchfile(file f, u64 offset, void *x)
+{
+    struct page_cache *k = f->c->cache;
+    client_lock(f->c);
+    void *data = x - (offset % k->pagesize);
+    page g;
+    vector_foreach(g, k->fetched)
+        if (g->data == data) {
+            release(k, g);
+            break;
+        }
+    client_unlock(f->c);
+}
+
+// only whole pages are added from a read
+void cache_fill(file f, void *source, u64 offset, u32 length)
+{
+    struct page_cache *k = f->c->cache;
+    if (!trusted(f)) return;
+    foreach_page(k, p, offset, length) {
+        if ((p < offset) || (p + k->pagesize > offset + length)) continue;
+        memcpy(insert(k, f, p)->data, source + (p - offset), k->pagesize);
+    }
+}
+
+static void drop_pages(struct page_cache *k, u8 len, u8 *fh)
+{
+    k->changes++;
+    for (page p = k->oldest, next; p; p = next) {
+        next = p->newer;
+        if ((p->len == len) && !memcmp(p->fh, fh, len)) remove_page(k, p);
+    }
+}
+
+static cached_file find_file(struct page_cache *k, file f)
+{
+    cached_file e;
+    vector_foreach(e, k->files)
+        if (same_fh(f, e->len, e->fh)) return e;
+    return 0;
+}
+
+void cache_invalidate(file f)
+{
+    struct page_cache *k = f->c->cache;
+    if (!k) return;
+    drop_pages(k, f->filehandle_len, f->filehandle);
+}
+
+// after a write, pages it only partly covers are patched if they're
+// already here. if the cache isn't trusted they're just dropped, and so
+// is the change the rest were checked against, since it no longer
+// describes them. the next check then starts the file over
+void cache_update(file f, void *source, u64 offset, u32 length)
+{
+    struct page_cache *k = f->c->cache;
+    if (!k) return;
+    boolean t = trusted(f);
+    k->changes++;
+    if (!t) {
+        cached_file e = find_file(k, f);
+        if (e) {
+            vector_remove(k->files, e);
+            deallocate(f->c->h, e, sizeof(struct cached_file));
+        }
+    }
+    foreach_page(k, p, offset, length) {
+        u64 start = MAX(p, offset), end = MIN(p + k->pagesize, offset + length);
+        page g = find(k, f, p);
+        if (!t) {
+            if (g) remove_page(k, g);
+            continue;
+        }
+        if (!g && (end - start == k->pagesize)) g = insert(k, f, p);
+        if (g) memcpy(g->data + (start - p), source + (start - offset), end - start);
+    }
+}
+
+// nothing may still be fetched
+void cache_destroy(client c)
+{
+    struct page_cache *k = c->cache;
+    if (!k) return;
+    while (k->oldest) remove_page(k, k->oldest);
+    cached_file e;
+    vector_foreach(e, k->files) deallocate(c->h, e, sizeof(struct cached_file));
+    deallocate_buffer(k->files);
+    deallocate_buffer(k->fetched);
+    deallocate(c->h, k->table, k->buckets * sizeof(page));
+    destroy(k->pages);
+    destroy(k->data);
+    deallocate(c->h, k, sizeof(struct page_cache));
+    c->cache = 0;
+}
+
+// the pages are good as long as the file hasn't changed since they were
+// last checked. our own writes change it too, so they're lost after a
+// write transaction
+void cache_revalidate(file f, u64 change)
+{
+    struct page_cache *k = f->c->cache;
+    if (!k) return;
+    cached_file found = find_file(k, f);
+    if (!found) {
+        // there can't be more files with pages than pages, so one goes
+        // along with whatever it still has
+        if (vector_length(k->files) >= k->capacity) {
+            cached_file old = vector_get(k->files, 0);
+            vector_remove(k->files, old);
+            drop_pages(k, old->len, old->fh);
+            deallocate(f->c->h, old, sizeof(struct cached_file));
+        }
+        found = allocate(f->c->h, sizeof(struct cached_file));
+        found->len = f->filehandle_len;
+        memcpy(found->fh, f->filehandle, f->filehandle_len);
+        vector_push(k->files, found);
+        cache_invalidate(f);
+    } else if (found->change != change) {
+        cache_invalidate(f);
+    }
+    found->change = change;
+}
+
+// the GETATTR of the change attribute that follows an op
+status parse_change(file f, buffer b)
+{
+    client c = f->c;
+    verify_and_adv(c, b, OP_GETATTR);
+    verify_and_adv(c, b, 0);
+    struct fattr a;
+    status s = parse_fattr(c, b, &a);
+    if (!is_ok(s)) return s;
+    if (!(a.mask & (1ull<<FATTR4_CHANGE)))
+        return allocate_status(c, "change missing from attributes");
+    cache_revalidate(f, a.change);
+    return STATUS_OK;
+}
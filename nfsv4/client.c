@@ -29,32 +29,82 @@ static void pf(char *header, file f)
     eprintf ("%s %s\n", header, (char *)b->contents);
 }
 
+// everything but the page cache, which fetchfile fills in place
+status read_uncached(file f, void *dest, u64 offset, u32 length)
+{
+    status s;
+    if (!readahead_read(f, dest, offset, length, &s)) {
+        ticks start = ktime();
+        // size calc off by the headers
+        s = segment(read_chunk, read_chunk_complete, OP_READ,
+                    f->c->maxresp, f, dest, offset, length);
+        if (is_ok(s)) measure_read(f->c, length, ktime() - start);
+    }
+    if (is_ok(s)) {
+        overlay_writes(f, dest, offset, length);
+        readahead_after(f, offset, length);
+    }
+    return s;
+}
+
 // should return the number of bytes read, can be short
 status readfile(file f, void *dest, u64 offset, u32 length)
 {
-    // size calc off by the headers
-    return segment(read_chunk, f->c->maxresp, f, dest, offset, length);
+    client_lock(f->c);
+    if (cache_read(f, dest, offset, length)) {
+        client_unlock(f->c);
+        return STATUS_OK;
+    }
+    status s = read_uncached(f, dest, offset, length);
+    if (is_ok(s)) cache_fill(f, dest, offset, length);
+    client_unlock(f->c);
+    return s;
 }
 
 status writefile(file f, void *dest, u64 offset, u32 length, u32 synch)
 {
-    // size calc off by the headers
-    return segment(write_chunk, f->c->maxreq, f, dest, offset, length);
+    client_lock(f->c);
+    readahead_drop(f);
+    status s;
+    if ((synch != SYNCH_COMMIT) && f->c->write_behind) {
+        s = write_behind(f, dest, offset, length, synch == SYNCH_REMOTE);
+    } else {
+        // anything held has to land first
+        s = flush_writes(f);
+        // size calc off by the headers
+        if (is_ok(s))
+            s = segment(write_chunk, write_chunk_complete, OP_WRITE,
+                        f->c->maxreq, f, dest, offset, length);
+    }
+    // some of it may have been written
+    if (is_ok(s)) cache_update(f, dest, offset, length);
+    else cache_invalidate(f);
+    client_unlock(f->c);
+    return s;
 }
 
-static status file_open_internal(file f, vector path, boolean writable, boolean create)
+static status file_open_locked(file f, vector path, boolean writable, boolean create)
 {
-    if (create && !writable) {
-        allocate_status(f->c, "file opened with create must be writable");
-    }
-    rpc r = allocate_rpc(f->c, f->c->forward);
+    if (create && !writable)
+        return allocate_status(f->c, "file opened with create must be writable");
+    rpc r = allocate_rpc(f->c, 0);
     push_sequence(r);
+    // the directory ops, then OPEN, GETFH and GETATTR
+    status st = push_bootstrap(r, vector_length(path) + 4);
+    if (!is_ok(st)) {
+        deallocate_rpc(r);
+        return st;
+    }
     buffer final = push_initial_path(r, path);
     u32 share_access = writable ? OPEN4_SHARE_ACCESS_BOTH : OPEN4_SHARE_ACCESS_READ;
     push_open(r, final, share_access, create);
     push_op(r, OP_GETFH);
-    buffer res = f->c->reverse;    
-    status st = transact(r, OP_OPEN, res);
+    // close-to-open, the cached pages are checked at open
+    if (f->c->cache) push_attr_request(r, 1ull<<FATTR4_CHANGE);
+    buffer res = r->result;
+    st = transact(r, OP_OPEN, res);
+    // it didn't get as far as RECLAIM_COMPLETE, the next open tries again
+    if (r->bootstrap) set_bootstrap(f->c, BOOTSTRAP_OWED);
     // macro this shortcut return
     if (!is_ok(st)) {
         deallocate_rpc(r);
@@ -69,57 +119,86 @@ static status file_open_internal(file f, vector path, boolean writable, boolean
     verify_and_adv(f->c, res, 0); // status
     u32 filehandle_len = read_beu32(f->c, res);
     if (filehandle_len > NFS4_FHSIZE) {
+        deallocate_rpc(r);
         return allocate_status(f->c, "encoding mismatch");
     }
     f->filehandle_len = filehandle_len;
     st = read_buffer(f->c, res, &f->filehandle, f->filehandle_len);
+    if (is_ok(st) && f->c->cache) {
+        res->start += pad(filehandle_len, 4) - filehandle_len;
+        st = parse_change(f, res);
+    }
     deallocate_rpc(r);
-    if (!is_ok(st)) return st;
-    return STATUS_OK;
+    return st;
 }
 
-status file_open_read(client c, vector path, file *dest)
+static status file_open_internal(file f, vector path, boolean writable, boolean create)
 {
-    file f = allocate(s->h, sizeof(struct file));
+    client_lock(f->c);
+    status s = file_open_locked(f, path, writable, create);
+    client_unlock(f->c);
+    return s;
+}
+
+static file allocate_file(client c, vector path)
+{
+    file f = allocate(c->h, sizeof(struct file));
+    memset(f, 0, sizeof(struct file));
     f->path = path;
     f->c = c;
+    f->delegation_type = OPEN_DELEGATE_NONE;
+    return f;
+}
+
+status file_open_read(client c, vector path, file *dest)
+{
+    file f = allocate_file(c, path);
     *dest = f;
     return file_open_internal(f, path, false, false);
 }
 
 status file_open_write(client c, vector path, file *dest)
 {
-    file f = allocate(s->h, sizeof(struct file));
-    f->path = path;
-    f->c = c;
+    file f = allocate_file(c, path);
     *dest = f;
     return file_open_internal(f, path, true, false);
 }
 
-void file_close(file f)
+status file_close(file f)
 {
-    // xxx - release delegations
+    status s = file_sync(f);
+    status rs = release_writes(f);
+    if (is_ok(s)) s = rs;
+    if ((f->delegation_type != OPEN_DELEGATE_NONE) &&
+        (f->delegation_epoch == f->c->delegation_epoch))
+        return_delegation(f);
+    client_lock(f->c);
+    if (f->ra) readahead_close(f);
+    drain_operations(f);
+    fh_save(f->c);
+    client_unlock(f->c);
+    deallocate(f->c->h, f, sizeof(struct file));
+    return s;
 }
 
 // create a tuple interface to parameterize user/access/etc
 status file_create(client c, vector path, file *dest)
 {
-    file f = allocate(s->h, sizeof(struct file));
-    f->path = path;
-    f->c = c;
+    file f = allocate_file(c, path);
     *dest = f;
     return file_open_internal(f, path, true, true);
 }
 
 status exists(client c, vector path)
 {
-    rpc r = allocate_rpc(c, c->forward);
+    client_lock(c);
+    rpc r = allocate_rpc(c, 0);
     push_sequence(r);
     push_resolution(r, path);
     push_op(r, OP_GETFH);
-    buffer res = c->reverse;    
-    status st = transact(r, OP_GETFH, res);
+    status st = transact(r, OP_GETFH, r->result);
     deallocate_rpc(r);    
+    client_unlock(c);
     if (!is_ok(st)) return st;    
     return STATUS_OK;
 
@@ -127,14 +206,15 @@ status exists(client c, vector path)
 
 status delete(client c, vector path)
 {
-    rpc r = allocate_rpc(c, c->forward);
+    client_lock(c);
+    rpc r = allocate_rpc(c, 0);
     push_sequence(r);
     buffer final = push_initial_path(r, path);
     push_op(r, OP_REMOVE);
     push_string(r->b, final->contents + final->start, length(final));
-    buffer res = r->c->reverse;
-    status s = transact(r, OP_REMOVE, res);
+    status s = transact(r, OP_REMOVE, r->result);
     deallocate_rpc(r);
+    client_unlock(c);
     if (!is_ok(s)) return s;    
     return STATUS_OK;
 }
@@ -149,10 +229,91 @@ status mkdir(client c, vector path)
 }
 
 
+// renew the lease whenever the session has sat idle for a third of it,
+// so a process that stays up between requests never has to rebuild the
+// session in front of one. a process that was frozen oversleeps, and
+// the session is checked and if need be rebuilt as soon as it thaws
+// sleeps on stop, so client_destroy doesn't have to wait out the interval
+static void keepalive_wait(client c, ticks until)
+{
+    struct timespec ts = {until >> 32, ((until & 0xffffffffull) * 1000000000ull) >> 32};
+    u32 depth = __atomic_load_n(&c->depth, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->depth, 0, __ATOMIC_RELEASE);
+    pthread_cond_timedwait(&c->stop, &c->lock, &ts);
+    __atomic_store_n(&c->owner, pthread_self(), __ATOMIC_RELAXED);
+    __atomic_store_n(&c->depth, depth, __ATOMIC_RELEASE);
+}
+
+static void *keepalive(void *x)
+{
+    client c = x;
+    client_lock(c);
+    while (!c->stopping) {
+        // 90 seconds is the usual default if the server didn't say
+        ticks interval = ((ticks)(c->lease ? c->lease : 90) << 32) / 3;
+        ticks due = c->renewed + interval;
+        // a request may have renewed it while we were waiting
+        if (ktime() < due) {
+            keepalive_wait(c, due);
+            continue;
+        }
+        if (!is_ok(renew_lease(c))) keepalive_wait(c, ktime() + interval);
+    }
+    client_unlock(c);
+    return 0;
+}
+
+void client_destroy(client c)
+{
+    client_lock(c);
+    c->stopping = true;
+    pthread_cond_broadcast(&c->stop);
+    client_unlock(c);
+    if (c->keepalive_running) pthread_join(c->keepalive, 0);
+
+    client_lock(c);
+    fh_destroy(c);
+    rpc_disconnect(c);
+    client_unlock(c);
+    if (c->epoll >= 0) close(c->epoll);
+    if (c->wakeup >= 0) close(c->wakeup);
+
+    connection n;
+    vector_foreach(n, c->connections) deallocate(0, n, sizeof(struct connection));
+    deallocate_buffer(c->connections);
+    deallocate(0, c->slots, c->maxreqs * sizeof(struct slot));
+    deallocate_buffer(c->pending);
+    deallocate_buffer(c->completed);
+    deallocate_buffer(c->waiting);
+    cache_destroy(c);
+    buffer b;
+    vector_foreach(b, c->spare) deallocate_buffer(b);
+    deallocate_buffer(c->spare);
+    if (c->header) deallocate_buffer(c->header);
+    deallocate_buffer(c->hostname);
+    if (c->operations) destroy(c->operations);
+    if (c->compounds) destroy(c->compounds);
+    destroy(c->rpcs);
+    pthread_cond_destroy(&c->stop);
+    pthread_cond_destroy(&c->received);
+    pthread_mutex_destroy(&c->lock);
+    deallocate(0, c, sizeof(struct client));
+}
+
 status create_client(char *hostname, client *dest)
 {
     client c = allocate(0, sizeof(struct client));
-    
+    c->h = 0;
+    c->rpcs = allocate_freelist(c->h, sizeof(struct rpc));
+    spare_init(c);
+    c->operations = 0;
+    c->compounds = 0;
+    c->delegation_epoch = 0;
+    c->rtt = 0;
+    c->bandwidth = 0;
+    cache_init(c);
+    c->header = 0;
+
     c->hostname = allocate_buffer(0, strlen(hostname) + 1);
     push_bytes(c->hostname, hostname, strlen(hostname));
     push_char(c->hostname, 0);
@@ -160,8 +321,28 @@ status create_client(char *hostname, client *dest)
     c->xid = 0xb956bea4;
     c->maxops = config_u64("NFS_OPS_LIMIT", 16);
     c->maxreqs = config_u64("NFS_REQUESTS_LIMIT", 32);
-    c->forward = allocate_buffer(0, 16384);
-    c->reverse = allocate_buffer(0, 16384);
+    c->io_depth = MAX(config_u64("NFS_IO_DEPTH", 8), 1);
+    c->t = &socket_transport;
+    if (!strcmp(config_string("NFS_TRANSPORT", "socket"), "uring"))
+        c->t = &uring_transport;
+    c->transport_state = 0;
+    int nconnect = MAX(config_u64("NFS_CONNECTIONS", 1), 1);
+    c->connections = allocate_vector(0, nconnect);
+    for (int i = 0; i < nconnect; i++) {
+        connection n = allocate(0, sizeof(struct connection));
+        n->c = c;
+        n->fd = -1;
+        n->transport_state = 0;
+        vector_push(c->connections, n);
+    }
+    c->slots = allocate(0, c->maxreqs * sizeof(struct slot));
+    memset(c->slots, 0, c->maxreqs * sizeof(struct slot));
+    c->slot_limit = 1;
+    c->pending = allocate_vector(0, c->maxreqs);
+    c->completed = allocate_vector(0, c->maxreqs);
+    c->waiting = allocate_vector(0, 1);
+    c->processing = false;
+    c->epoll = c->wakeup = -1;
 
     // xxx - we're actually using very few bits from tv_usec, make a better
     // instance id
@@ -171,10 +352,32 @@ status create_client(char *hostname, client *dest)
     assert(NFS4_VERIFIER_SIZE == sizeof(u64));
     memcpy(c->instance_verifier, &verifier, NFS4_VERIFIER_SIZE);
 
+    memset(c->session, 0, NFS4_SESSIONID_SIZE);
+    rpc_templates(c);
+
+    c->fhcache = allocate_vector(0, 8);
+    c->fhcache_dirty = false;
+    fh_load(c);
+
     c->maxresp = config_u64("NFS_READ_LIMIT", 1024*1024);
     c->maxreq = config_u64("NFS_WRITE_LIMIT", 1024*1024);
+    c->write_behind = config_u64("NFS_WRITE_BEHIND", 0);
+
+    pthread_mutex_init(&c->lock, 0);
+    pthread_cond_init(&c->received, 0);
+    c->depth = 0;
+    c->receiving = c->connecting = false;
+    c->generation = 0;
+    c->bootstrap = BOOTSTRAP_OWED;
+    c->lease = 0;
+    pthread_cond_init(&c->stop, 0);
+    c->stopping = false;
+    c->keepalive_running = false;
 
     *dest = c;
-    return rpc_connection(c);
+    status s = rpc_connection(c);
+    if (is_ok(s) && config_boolean("NFS_KEEPALIVE", false))
+        c->keepalive_running = pthread_create(&c->keepalive, 0, keepalive, c) == 0;
+    return s;
 }
  
@@ -3,8 +3,8 @@ typedef struct codepoint {
     u32 value;
 } *codepoint;
 
-// only one in flight at a time :/
-static char temp_set[1024];
+// one per thread, good until that thread makes the next call
+static __thread char temp_set[1024];
 
 static inline char *codepoint_set_string(codepoint set, u64 flags)
 {
@@ -1,7 +1,9 @@
 static inline boolean config_boolean(char *name, boolean def)
 {
-    // xxx parse this! so we can turn off default true
-    return getenv(name)?true:def;
+    char *x = getenv(name);
+    if (!x) return def;
+    // so that a default of true can be turned off
+    return strcmp(x, "false") && strcmp(x, "0") && strcmp(x, "no") && strcmp(x, "off");
 }
 
 static inline u64 config_u64(char *name, u64 def)
@@ -9,6 +11,12 @@ static inline u64 config_u64(char *name, u64 def)
     u64 result = 0;
     char *x = getenv(name);
     if (!x) return def;
-    for (char *i = x; *i; i++) result = result + 10 * (*i - '0');
+    for (char *i = x; *i; i++) result = result * 10 + (*i - '0');
     return result;
 }
+
+static inline char *config_string(char *name, char *def)
+{
+    char *x = getenv(name);
+    return x?x:def;
+}
@@ -0,0 +1,220 @@
+#include <nfs4_internal.h>
+#include <stdio.h>
+
+// directory filehandles by path, so resolving a name can start with a
+// PUTFH of its deepest known directory rather than a LOOKUP per
+// component from the root. filehandles are persistent (rfc 5661 4.2.2),
+// so they survive new sessions. if NFS_FH_CACHE names a file the cache
+// is loaded from it at startup and rewritten when a file is closed after
+// entries were added, which lets a fresh process skip the lookups
+// entirely. a stale handle drops the whole thing
+
+typedef struct fh_entry {
+    buffer path; // components joined by '/'
+    int depth;
+    u8 len;
+    u8 fh[NFS4_FHSIZE];
+} *fh_entry;
+
+static buffer prefix_key(heap h, vector path, int depth)
+{
+    buffer b = allocate_buffer(h, 64);
+    for (int i = 0; i < depth; i++) {
+        buffer c = vector_get(path, i);
+        if (i) push_char(b, '/');
+        push_bytes(b, c->contents + c->start, length(c));
+    }
+    return b;
+}
+
+static fh_entry find(client c, buffer key)
+{
+    fh_entry e;
+    vector_foreach(e, c->fhcache)
+        if ((length(e->path) == length(key)) &&
+            !memcmp(e->path->contents + e->path->start, key->contents + key->start, length(key)))
+            return e;
+    return 0;
+}
+
+// the deepest cached directory among the first count components of path.
+// the key for each depth is a prefix of the one for count
+static fh_entry fh_lookup(client c, vector path, int count)
+{
+    bytes total = 0, ends[count + 1];
+    for (int i = 0; i < count; i++) total += length((buffer)vector_get(path, i)) + 1;
+    char space[total + 1];
+    struct buffer key = {.h = 0, .start = 0, .end = 0, .capacity = total + 1, .contents = space};
+    ends[0] = 0;
+    for (int i = 0; i < count; i++) {
+        buffer n = vector_get(path, i);
+        if (i) push_char(&key, '/');
+        push_bytes(&key, n->contents + n->start, length(n));
+        ends[i + 1] = key.end;
+    }
+    for (int depth = count; depth > 0; depth--) {
+        key.end = ends[depth];
+        fh_entry e = find(c, &key);
+        if (e) return e;
+    }
+    return 0;
+}
+
+// called with the client lock held
+void fh_save(client c)
+{
+    char *name = config_string("NFS_FH_CACHE", 0);
+    if (!c->fhcache_dirty || !name) return;
+    c->fhcache_dirty = false;
+    // the server is part of the key
+    buffer b = allocate_buffer(c->h, 1024);
+    push_be32(b, length(c->hostname));
+    push_bytes(b, c->hostname->contents + c->hostname->start, length(c->hostname));
+    fh_entry e;
+    vector_foreach(e, c->fhcache) {
+        push_be32(b, length(e->path));
+        push_bytes(b, e->path->contents + e->path->start, length(e->path));
+        push_be32(b, e->depth);
+        push_be32(b, e->len);
+        push_bytes(b, e->fh, e->len);
+    }
+    // other processes may be loading it
+    char temp[strlen(name) + 32];
+    sprintf(temp, "%s.%d", name, getpid());
+    FILE *f = fopen(temp, "w");
+    if (!f) {
+        deallocate_buffer(b);
+        return;
+    }
+    boolean ok = fwrite(b->contents + b->start, length(b), 1, f) == 1;
+    if ((fclose(f) == 0) && ok) rename(temp, name);
+    else unlink(temp);
+    deallocate_buffer(b);
+}
+
+static void fh_insert(client c, buffer key, int depth, u8 *fh, u32 len)
+{
+    fh_entry e = find(c, key);
+    if (!e) {
+        e = allocate(c->h, sizeof(struct fh_entry));
+        e->path = key;
+        vector_push(c->fhcache, e);
+    } else {
+        deallocate_buffer(key);
+    }
+    e->depth = depth;
+    e->len = len;
+    memcpy(e->fh, fh, len);
+}
+
+static status parse_cache(client c, buffer b)
+{
+    u32 hlen = read_beu32(c, b);
+    if ((hlen != length(c->hostname)) || (length(b) < hlen) ||
+        memcmp(b->contents + b->start, c->hostname->contents + c->hostname->start, hlen))
+        return allocate_status(c, "filehandle cache is for another server");
+    b->start += hlen;
+    while (length(b)) {
+        u32 plen = read_beu32(c, b);
+        if (length(b) < plen) return allocate_status(c, "out of data");
+        buffer key = allocate_buffer(c->h, plen + 1);
+        push_bytes(key, b->contents + b->start, plen);
+        b->start += plen;
+        u32 depth = read_beu32(c, b);
+        u32 len = read_beu32(c, b);
+        if ((len > NFS4_FHSIZE) || (length(b) < len)) {
+            deallocate_buffer(key);
+            return allocate_status(c, "encoding mismatch");
+        }
+        fh_insert(c, key, depth, b->contents + b->start, len);
+        b->start += len;
+    }
+    return STATUS_OK;
+}
+
+void fh_load(client c)
+{
+    char *name = config_string("NFS_FH_CACHE", 0);
+    if (!name) return;
+    FILE *f = fopen(name, "r");
+    if (!f) return;
+    buffer b = allocate_buffer(c->h, 4096);
+    size_t n;
+    do {
+        buffer_extend(b, 4096);
+        n = fread(b->contents + b->end, 1, 4096, f);
+        b->end += n;
+    } while (n > 0);
+    fclose(f);
+    status s = parse_cache(c, b);
+    if (!is_ok(s) && config_boolean("NFS_TRACE", false))
+        eprintf("ignoring filehandle cache %s: %s\n", name, status_string(s));
+    deallocate_buffer(b);
+}
+
+static void fh_clear(client c)
+{
+    fh_entry e;
+    vector_foreach(e, c->fhcache) {
+        deallocate_buffer(e->path);
+        deallocate(c->h, e, sizeof(struct fh_entry));
+    }
+    c->fhcache->start = c->fhcache->end = 0;
+}
+
+void fh_invalidate(client c)
+{
+    if (!vector_length(c->fhcache)) return;
+    fh_clear(c);
+    c->fhcache_dirty = true;
+}
+
+// anything not written out yet goes first
+void fh_destroy(client c)
+{
+    fh_save(c);
+    fh_clear(c);
+    deallocate_buffer(c->fhcache);
+    c->fhcache = 0;
+}
+
+// the GETFH that push_directory left after the lookups
+status fh_fill(rpc r, buffer b)
+{
+    client c = r->c;
+    u32 len = read_beu32(c, b);
+    if ((len > NFS4_FHSIZE) || (length(b) < len))
+        return allocate_status(c, "encoding mismatch");
+    fh_insert(c, prefix_key(c->h, r->fill, r->fill_depth), r->fill_depth,
+              b->contents + b->start, len);
+    b->start += pad(len, 4);
+    r->fill = 0;
+    c->fhcache_dirty = true;
+    return STATUS_OK;
+}
+
+// set the current filehandle to the directory made of the first count
+// components of path
+void push_directory(rpc r, vector path, int count)
+{
+    client c = r->c;
+    fh_entry e = fh_lookup(c, path, count);
+    int depth = 0;
+    if (e) {
+        push_op(r, OP_PUTFH);
+        push_string(r->b, (char *)e->fh, e->len);
+        depth = e->depth;
+    } else {
+        push_op(r, OP_PUTROOTFH);
+    }
+    for (int i = depth; i < count; i++) {
+        buffer n = vector_get(path, i);
+        push_op(r, OP_LOOKUP);
+        push_string(r->b, n->contents + n->start, length(n));
+    }
+    if (depth < count) {
+        push_op(r, OP_GETFH);
+        r->fill = path;
+        r->fill_depth = count;
+    }
+}
@@ -0,0 +1,147 @@
+
+// objects of one size. freed ones are threaded onto a list and
+// handed out again before going back to the parent
+typedef struct freelist {
+    struct heap h;
+    heap parent;
+    bytes size;
+    void *free;
+} *freelist;
+
+static void *freelist_alloc(heap h, bytes b)
+{
+    freelist f = (freelist)h;
+    if (b > f->size) panic("freelist allocation too large");
+    void *x = f->free;
+    if (!x) return allocate(f->parent, f->size);
+    f->free = *(void **)x;
+    return x;
+}
+
+static void freelist_dealloc(heap h, void *x, bytes b)
+{
+    freelist f = (freelist)h;
+    *(void **)x = f->free;
+    f->free = x;
+}
+
+// objects still outstanding aren't tracked, and are the callers problem
+static void freelist_destroy(heap h)
+{
+    freelist f = (freelist)h;
+    while (f->free) {
+        void *x = f->free;
+        f->free = *(void **)x;
+        deallocate(f->parent, x, f->size);
+    }
+    deallocate(f->parent, f, sizeof(struct freelist));
+}
+
+static heap allocate_freelist(heap parent, bytes size)
+{
+    freelist f = allocate(parent, sizeof(struct freelist));
+    f->h.alloc = freelist_alloc;
+    f->h.dealloc = freelist_dealloc;
+    f->h.destroy = freelist_destroy;
+    f->parent = parent;
+    f->size = MAX(size, sizeof(void *));
+    f->free = 0;
+    return (heap)f;
+}
+
+// bump allocation out of pages, nothing is given back until the
+// whole arena is destroyed
+typedef struct arena_page {
+    struct arena_page *next;
+    bytes size;
+} *arena_page;
+
+typedef struct arena {
+    struct heap h;
+    heap parent;
+    arena_page pages;
+    bytes offset;
+    bytes pagesize;
+} *arena;
+
+static void *arena_alloc(heap h, bytes b)
+{
+    arena a = (arena)h;
+    b = (b + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (!a->pages || (a->offset + b > a->pages->size)) {
+        bytes size = MAX(a->pagesize, b + sizeof(struct arena_page));
+        arena_page p = allocate(a->parent, size);
+        p->size = size;
+        p->next = a->pages;
+        a->pages = p;
+        a->offset = sizeof(struct arena_page);
+    }
+    void *x = (void *)a->pages + a->offset;
+    a->offset += b;
+    return x;
+}
+
+static void arena_dealloc(heap h, void *x, bytes b)
+{
+}
+
+static void arena_destroy(heap h)
+{
+    arena a = (arena)h;
+    while (a->pages) {
+        arena_page p = a->pages;
+        a->pages = p->next;
+        deallocate(a->parent, p, p->size);
+    }
+    deallocate(a->parent, a, sizeof(struct arena));
+}
+
+static heap allocate_arena(heap parent, bytes pagesize)
+{
+    arena a = allocate(parent, sizeof(struct arena));
+    a->h.alloc = arena_alloc;
+    a->h.dealloc = arena_dealloc;
+    a->h.destroy = arena_destroy;
+    a->parent = parent;
+    a->pages = 0;
+    a->offset = 0;
+    a->pagesize = pagesize;
+    return (heap)a;
+}
+
+// memory aligned to a power of two, i.e. for pages that are handed out
+// as they are. everything goes straight back to the system
+typedef struct aligned {
+    struct heap h;
+    heap parent;
+    bytes align;
+} *aligned;
+
+static void *aligned_alloc_heap(heap h, bytes b)
+{
+    void *x;
+    if (posix_memalign(&x, ((aligned)h)->align, b)) panic("aligned allocation failed");
+    return x;
+}
+
+static void aligned_dealloc(heap h, void *x, bytes b)
+{
+    free(x);
+}
+
+static void aligned_destroy(heap h)
+{
+    aligned a = (aligned)h;
+    deallocate(a->parent, a, sizeof(struct aligned));
+}
+
+static heap allocate_aligned(heap parent, bytes align)
+{
+    aligned a = allocate(parent, sizeof(struct aligned));
+    a->h.alloc = aligned_alloc_heap;
+    a->h.dealloc = aligned_dealloc;
+    a->h.destroy = aligned_destroy;
+    a->parent = parent;
+    a->align = align;
+    return (heap)a;
+}
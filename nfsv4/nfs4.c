@@ -5,22 +5,64 @@ SQLITE_EXTENSION_INIT1
 #include <config.h>
 #include <stdio.h>
 #include <assert.h>
+#include <pthread.h>
 
 #define ORIGVFS(p) (((appd)(p)->pAppData)->parent)
 
+// a session to a server and how many open files are on it
+typedef struct session {
+    client c;
+    u32 files;
+    ticks idle; // since files went to zero
+} *session;
+
+// sessions are kept per server after their files close, so the next
+// open finds one ready, until they've been idle for NFS_SESSION_IDLE.
+// new ones are set up without the vfs lock, and counted in connecting
+// meanwhile so nobody makes another one than they need
+typedef struct host {
+    buffer name;
+    vector sessions;
+    u32 connecting;
+    pthread_cond_t connected; // a new session is up, or didn't make it
+} *host;
+
 typedef struct appd {
     sqlite3_vfs *parent;
-    client c; // xxx - single server assumption
+    vector hosts;
+    u32 session_limit; // per host
+    ticks session_idle; // before an unused session is let go, zero for never
     char *current_error;
     boolean trace;
+    boolean shm_file; // keep the wal-index on the server
+    vector shm; // files with a mapped wal-index
+    ticks lazy_unlock; // how long an unused SHARED lock is kept
+    vector retained; // files keeping one
+    pthread_cond_t retaining; // one was added, for the reaper
+    pthread_cond_t released; // the reaper let go of one
+    // hosts, shm and retained are shared by connections on any thread
+    pthread_mutex_t lock;
 } *appd;
      
 
 typedef struct sqlfile {
     sqlite3_file base;              /* IO methods */
     appd ad;
+    session s;
     client c;
     file f;
+    heap h; // the path lives as long as the file
+    vector path;
+    vector shm; // wal-index regions
+    int shm_size;
+    sqlite3_int64 mmap_size;
+    ticks retained; // when sqlite let go of a SHARED lock we kept, or zero
+    boolean releasing; // the reaper is sending the LOCKU for it
+    file shmf; // with shm_file
+    vector shadow;
+    u64 shm_change;
+    u8 shm_exclusive; // index locks held exclusive
+    boolean shm_current; // pulled since our index locks last changed
     int eFileLock;
     boolean powersafe;
     boolean readonly;
@@ -35,6 +77,151 @@ static void buffer_wrap_string(buffer b, char *x)
     b->start = 0;
 }
 
+// names are server/path/to/file, the server comes back terminated
+static vector split_name(heap h, const char *z, buffer *server)
+{
+    struct buffer znb;
+    buffer_wrap_string(&znb, (char *)z);
+    vector path = split(h, &znb, '/');
+    *server = vector_pop(path);
+    push_char(*server, 0);
+    return path;
+}
+
+// takes the sessions idle past the limit out of the hosts, they're
+// destroyed by the caller without the lock
+static void expire_sessions(appd ad, vector expired)
+{
+    if (!ad->session_idle) return;
+    ticks now = ktime();
+    host x;
+    vector_foreach(x, ad->hosts) {
+        for (int i = vector_length(x->sessions) - 1; i >= 0; i--) {
+            session s = vector_get(x->sessions, i);
+            if (s->files || (now - s->idle < ad->session_idle)) continue;
+            vector_remove(x->sessions, s);
+            vector_push(expired, s);
+        }
+    }
+}
+
+static void destroy_sessions(vector expired)
+{
+    session s;
+    vector_foreach(s, expired) {
+        client_destroy(s->c);
+        deallocate(0, s, sizeof(struct session));
+    }
+    deallocate_buffer(expired);
+}
+
+static host find_host(appd ad, buffer server)
+{
+    host x;
+    vector_foreach(x, ad->hosts)
+        if ((length(x->name) == length(server)) &&
+            !memcmp(x->name->contents + x->name->start, server->contents + server->start, length(server)))
+            return x;
+    x = allocate(0, sizeof(struct host));
+    x->name = allocate_buffer(0, length(server));
+    buffer_concat(x->name, server);
+    x->sessions = allocate_vector(0, 2);
+    x->connecting = 0;
+    pthread_cond_init(&x->connected, 0);
+    vector_push(ad->hosts, x);
+    return x;
+}
+
+static session least_busy(host x)
+{
+    session best = 0, s;
+    vector_foreach(s, x->sessions)
+        if (!best || (s->files < best->files)) best = s;
+    return best;
+}
+
+// the least busy session to the server. opens get a new one if they're
+// all in use and there's room under NFS_SESSIONS, and if one is already
+// being set up that's waited for rather than making another
+static status borrow_session(appd ad, buffer server, boolean grow, session *dest)
+{
+    vector expired = allocate_vector(0, 2);
+    status st = STATUS_OK;
+    pthread_mutex_lock(&ad->lock);
+    expire_sessions(ad, expired);
+    host x = find_host(ad, server);
+    session best;
+    while (1) {
+        best = least_busy(x);
+        u32 count = vector_length(x->sessions) + x->connecting;
+        if (best && !(grow && best->files && (count < ad->session_limit))) break;
+        if (!best && x->connecting) {
+            pthread_cond_wait(&x->connected, &ad->lock);
+            continue;
+        }
+        x->connecting++;
+        pthread_mutex_unlock(&ad->lock);
+        client c;
+        st = create_client((char *)x->name->contents + x->name->start, &c);
+        if (!is_ok(st)) client_destroy(c);
+        pthread_mutex_lock(&ad->lock);
+        x->connecting--;
+        pthread_cond_broadcast(&x->connected);
+        if (is_ok(st)) {
+            best = allocate(0, sizeof(struct session));
+            best->c = c;
+            best->files = 0;
+            vector_push(x->sessions, best);
+            break;
+        }
+        // otherwise share one that's already up, or came up meanwhile
+        if ((best = least_busy(x))) break;
+        pthread_mutex_unlock(&ad->lock);
+        destroy_sessions(expired);
+        return st;
+    }
+    best->files++;
+    *dest = best;
+    pthread_mutex_unlock(&ad->lock);
+    destroy_sessions(expired);
+    return STATUS_OK;
+}
+
+static void return_session(appd ad, session s)
+{
+    vector expired = allocate_vector(0, 2);
+    pthread_mutex_lock(&ad->lock);
+    if (!--s->files) s->idle = ktime();
+    expire_sessions(ad, expired);
+    pthread_mutex_unlock(&ad->lock);
+    destroy_sessions(expired);
+}
+
+// NFS_HOSTS are connected from a thread of their own as soon as the
+// extension loads, so the lookup, connect and session setup are under
+// way while sqlite gets to the open. an open that comes in meanwhile
+// waits for the session in borrow_session instead of making another
+static void *preconnect(void *x)
+{
+    appd ad = x;
+    struct buffer list;
+    buffer_wrap_string(&list, config_string("NFS_HOSTS", ""));
+    heap h = allocate_arena(0, 256);
+    vector hosts = split(h, &list, ',');
+    buffer server;
+    vector_foreach(server, hosts) {
+        if (!length(server)) continue;
+        push_char(server, 0);
+        session s;
+        status st = borrow_session(ad, server, false, &s);
+        if (is_ok(st)) return_session(ad, s);
+        else if (ad->trace)
+            eprintf("preconnect %s %s\n", (char *)server->contents + server->start, status_string(st));
+    }
+    destroy(h);
+    return 0;
+}
+
 // try to translate if we can...maybe use unix errno in status as a translation bridge
 // SQLITE_BUSY
 // SQLITE_LOCKED
@@ -54,12 +241,20 @@ static inline int translate_status(appd ad, status s)
     return SQLITE_OK;
 }
     
+static int nfs4ShmUnmap(sqlite3_file *pFile, int deleteFlag);
+static void release_shared(sqlfile f);
+static boolean unretain(sqlfile f);
+
 static int nfs4Close(sqlite3_file *pFile){
     sqlfile f = (sqlfile)pFile;
     if (f->ad->trace)
         eprintf ("close %s\n", f->filename);
-    file_close(f->f);
-    return SQLITE_OK;
+    if (f->shm) nfs4ShmUnmap(pFile, 0);
+    if (unretain(f)) release_shared(f);
+    status s = file_close(f->f);
+    return_session(f->ad, f->s);
+    destroy(f->h);
+    return translate_status(f->ad, s);
 }
 
 static int nfs4Read(sqlite3_file *pFile, 
@@ -71,7 +266,7 @@ static int nfs4Read(sqlite3_file *pFile,
     if (f->ad->trace) {
         eprintf ("read %s offset:%lld bytes:%d ", f->filename, iOfst, iAmt);
     }
-    translate_status(f->ad, readfile(f->f, zBuf, iOfst, iAmt));
+    return translate_status(f->ad, readfile(f->f, zBuf, iOfst, iAmt));
 }
 
 static int nfs4Write(sqlite3_file *pFile,
@@ -82,7 +277,7 @@ static int nfs4Write(sqlite3_file *pFile,
     sqlfile f = (sqlfile)pFile;
     if (f->ad->trace) 
         eprintf ("write %s offset:%lld bytes:%d ", f->filename, iOfst, iAmt);
-    translate_status(f->ad, writefile(f->f, (void *)z, iOfst, iAmt, SYNCH_REMOTE));
+    return translate_status(f->ad, writefile(f->f, (void *)z, iOfst, iAmt, SYNCH_LOCAL));
 }
 
 static int nfs4Truncate(sqlite3_file *pFile,
@@ -90,17 +285,16 @@ static int nfs4Truncate(sqlite3_file *pFile,
 {
     sqlfile f = (sqlfile)pFile;
     if (f->ad->trace) 
-        eprintf ("truncate %s - WARNING NOT IMPLEMENTED\n", f->filename);
-    return SQLITE_ERROR;
-
+        eprintf ("truncate %s size:%lld ", f->filename, size);
+    return translate_status(f->ad, file_truncate(f->f, size));
 }
 
 static int nfs4Sync(sqlite3_file *pFile, int flags)
 { 
    sqlfile f = (sqlfile)pFile;
    if (f->ad->trace) 
-       eprintf ("sync %s\n", f->filename);
-    return SQLITE_OK;
+       eprintf ("sync %s ", f->filename);
+    return translate_status(f->ad, file_sync(f->f));
 }
 
 static int nfs4FileSize(sqlite3_file *pFile, sqlite_int64 *pSize)
@@ -135,17 +329,86 @@ static struct codepoint locktypes[] = {
 #define PENDING_LOCK    3
 #define EXCLUSIVE_LOCK  4
 
+#define STEP(__unlock, __type, __start, __len) (struct lock_step){__unlock, __type, __start, __len}
+
+// with NFS_LAZY_UNLOCK, going from SHARED to NO_LOCK keeps the shared
+// range on the server, and the next SHARED is free if it comes within
+// that many milliseconds. nothing tells us when another host wants to
+// write, since nfs has no callback for lock conflicts, so the timeout is
+// also how long a writer can be kept waiting. the reaper thread lets go
+// of them as they expire, and close does right away
+static void release_shared(sqlfile f)
+{
+    struct lock_step s = STEP(true, READ_LT, SHARED_FIRST, SHARED_SIZE);
+    int done;
+    if (f->ad->trace)
+        eprintf ("release shared %s ", f->filename);
+    translate_status(f->ad, lock_steps(f->f, &s, 1, &done));
+}
+
+// the retained files may belong to connections on other threads, so
+// the list is under the vfs lock, but the LOCKUs are sent outside it.
+// true if f was keeping one, which is now the callers to use or drop.
+// a release the reaper has already started is waited out
+static boolean unretain(sqlfile f)
+{
+    appd ad = f->ad;
+    pthread_mutex_lock(&ad->lock);
+    while (f->releasing) pthread_cond_wait(&ad->released, &ad->lock);
+    boolean kept = f->retained != 0;
+    if (kept) {
+        vector_remove(ad->retained, f);
+        f->retained = 0;
+    }
+    pthread_mutex_unlock(&ad->lock);
+    return kept;
+}
+
+static void *reaper(void *x)
+{
+    appd ad = x;
+    pthread_mutex_lock(&ad->lock);
+    while (1) {
+        ticks now = ktime(), next = 0;
+        sqlfile f, expired = 0;
+        vector_foreach(f, ad->retained) {
+            ticks due = f->retained + ad->lazy_unlock;
+            if (due <= now) {
+                expired = f;
+                break;
+            }
+            if (!next || (due < next)) next = due;
+        }
+        if (expired) {
+            vector_remove(ad->retained, expired);
+            expired->retained = 0;
+            expired->releasing = true;
+            pthread_mutex_unlock(&ad->lock);
+            release_shared(expired);
+            pthread_mutex_lock(&ad->lock);
+            expired->releasing = false;
+            pthread_cond_broadcast(&ad->released);
+            continue;
+        }
+        if (!next) {
+            pthread_cond_wait(&ad->retaining, &ad->lock);
+            continue;
+        }
+        struct timespec ts = {next >> 32, ((next & 0xffffffffull) * 1000000000ull) >> 32};
+        pthread_cond_timedwait(&ad->retaining, &ad->lock, &ts);
+    }
+    return 0;
+}
+
 /*
-** Adapted from SQLite's locking implementation in os_unix.c
+** Adapted from SQLite's locking implementation in os_unix.c. each
+** transition is a single compound, see lock_steps
 */
 static int nfs4Lock(sqlite3_file *pFile, int eFileLock)
 {
     sqlfile f = (sqlfile)pFile;
-
-    u64 l_start;
-    u64 l_len = 1L;
-    u32 l_type;
-    status st;
+    struct lock_step steps[3];
+    int n = 0, done;
 
     assert(f);
 
@@ -159,6 +422,23 @@ static int nfs4Lock(sqlite3_file *pFile, int eFileLock)
         return SQLITE_OK;
     }
 
+    if (unretain(f)) {
+        assert(eFileLock==SHARED_LOCK);
+        // still has to get past the pending byte like any new reader, or
+        // a writer waiting for the readers to drain would never get in
+        steps[n++] = STEP(false, READ_LT, PENDING_BYTE, 1);
+        steps[n++] = STEP(true, READ_LT, PENDING_BYTE, 1);
+        status st = lock_steps(f->f, steps, n, &done);
+        if (is_ok(st)) {
+            f->eFileLock = SHARED_LOCK;
+            return SQLITE_OK;
+        }
+        // and if there is one it can have the shared range too
+        if (done == 1) lock_steps(f->f, steps + 1, 1, &done);
+        release_shared(f);
+        return translate_status(f->ad, st);
+    }
+
     /* Make sure the locking sequence is correct.
     **  (1) We never move from unlocked to anything higher than shared lock.
     **  (2) SQLite never explicitly requests a pendig lock.
@@ -168,63 +448,34 @@ static int nfs4Lock(sqlite3_file *pFile, int eFileLock)
     assert( eFileLock!=PENDING_LOCK );
     assert( eFileLock!=RESERVED_LOCK || f->eFileLock==SHARED_LOCK );
 
-
     /* A PENDING lock is needed before acquiring a SHARED lock and before
     ** acquiring an EXCLUSIVE lock.  For the SHARED lock, the PENDING will
     ** be released.
     */
-    if(eFileLock==SHARED_LOCK
-            || (eFileLock==EXCLUSIVE_LOCK && f->eFileLock<PENDING_LOCK)){
-        l_type = (eFileLock==SHARED_LOCK?READ_LT:WRITE_LT);
-        l_start = PENDING_BYTE;
-        st = lock_range(f->f, l_type, l_start, l_len);
-        if (!is_ok(st)) {
-            return translate_status(f->ad, st);
-        }
-    }
-
-  /* If control gets to this point, then actually go ahead and make
-  ** operating system calls for the specified lock.
-  */
-    if (eFileLock==SHARED_LOCK){
-        /* Now get the read-lock */
-        l_start = SHARED_FIRST;
-        l_len = SHARED_SIZE;
-        st = lock_range(f->f, l_type, l_start, l_len);
-        if (!is_ok(st)) {
-            return translate_status(f->ad, st);
-        }
-        /* Drop the temporary PENDING lock */
-        l_start = PENDING_BYTE;
-        l_len = 1L;
-        st = unlock_range(f->f, l_type, l_start, l_len);
-        if (!is_ok(st)) {
-            return translate_status(f->ad, st);
-        }
+    if (eFileLock==SHARED_LOCK) {
+        steps[n++] = STEP(false, READ_LT, PENDING_BYTE, 1);
+        steps[n++] = STEP(false, READ_LT, SHARED_FIRST, SHARED_SIZE);
+        steps[n++] = STEP(true, READ_LT, PENDING_BYTE, 1);
+    } else if (eFileLock==RESERVED_LOCK) {
+        steps[n++] = STEP(false, WRITE_LT, RESERVED_BYTE, 1);
     } else {
-        /* The request was for a RESERVED or EXCLUSIVE lock.  It is
-        ** assumed that there is a SHARED or greater lock on the file
-        ** already.
-        */
-        l_type = WRITE_LT;
-        assert(0 != f->eFileLock);
-        assert(eFileLock==RESERVED_LOCK || eFileLock==EXCLUSIVE_LOCK);
-        if (eFileLock==RESERVED_LOCK) {
-            l_start = RESERVED_BYTE;
-            l_len = 1L;
-        } else {
-            l_start = SHARED_FIRST;
-            l_len = SHARED_SIZE;
-        }
+        if (f->eFileLock<PENDING_LOCK)
+            steps[n++] = STEP(false, WRITE_LT, PENDING_BYTE, 1);
+        steps[n++] = STEP(false, WRITE_LT, SHARED_FIRST, SHARED_SIZE);
+    }
 
-        st = lock_range(f->f, l_type, l_start, l_len);
-        if (!is_ok(st)) {
-            return translate_status(f->ad, st);
-        }
+    status st = lock_steps(f->f, steps, n, &done);
+    if (!is_ok(st)) {
+        // a reader that didn't get in doesn't keep the pending byte, but
+        // a writer does so no new readers show up while it waits
+        if ((eFileLock==SHARED_LOCK) && (done==1))
+            lock_steps(f->f, steps + 2, 1, &done);
+        if ((eFileLock==EXCLUSIVE_LOCK) && (n==2) && (done==1))
+            f->eFileLock = PENDING_LOCK;
+        return translate_status(f->ad, st);
     }
     f->eFileLock = eFileLock;
     return SQLITE_OK;
-    // return translate_status(f->ad, lock_range(f->f, WRITE_LT, 0x40000000, 512));
 }
 
 /*
@@ -233,11 +484,8 @@ static int nfs4Lock(sqlite3_file *pFile, int eFileLock)
 static int nfs4Unlock(sqlite3_file *pFile, int eFileLock)
 {
     sqlfile f = (sqlfile)pFile;
-
-    u64 l_start;
-    u64 l_len = 1L;
-    u32 l_type;
-    status st;
+    struct lock_step steps[3];
+    int n = 0, done;
 
     if (f->ad->trace)
         eprintf ("unlock %s %s\n", ((sqlfile)pFile)->filename, codestring(locktypes, eFileLock));
@@ -249,32 +497,26 @@ static int nfs4Unlock(sqlite3_file *pFile, int eFileLock)
         return SQLITE_OK;
     }
 
+    boolean keep = (eFileLock == NO_LOCK) && f->ad->lazy_unlock;
     if (f->eFileLock>SHARED_LOCK) {
-        if (eFileLock == SHARED_LOCK) {
-            l_type = READ_LT;
-            l_start = SHARED_FIRST;
-            l_len = SHARED_SIZE;
-            st = lock_range(f->f, l_type, l_start, l_len);
-            if (!is_ok(st)) {
-                return translate_status(f->ad, st);
-            }
-        }
+        if ((eFileLock == SHARED_LOCK) || keep)
+            steps[n++] = STEP(false, READ_LT, SHARED_FIRST, SHARED_SIZE);
+        assert( PENDING_BYTE+1==RESERVED_BYTE );
+        steps[n++] = STEP(true, READ_LT, PENDING_BYTE, 2);
+    }
+    if ((eFileLock == NO_LOCK) && !keep)
+        steps[n++] = STEP(true, READ_LT, SHARED_FIRST, SHARED_SIZE);
 
-        l_type = READ_LT;
-        l_start = PENDING_BYTE;
-        l_len = 2L;  assert( PENDING_BYTE+1==RESERVED_BYTE );
-        st = unlock_range(f->f, l_type, l_start, l_len);
-        if (!is_ok(st)) {
-            return translate_status(f->ad, st);
-        }
+    if (n) {
+        status st = lock_steps(f->f, steps, n, &done);
+        if (!is_ok(st)) return translate_status(f->ad, st);
     }
-    if (eFileLock == NO_LOCK) {
-        l_start = SHARED_FIRST;
-        l_len = SHARED_SIZE;
-        st = unlock_range(f->f, l_type, l_start, l_len);
-        if (!is_ok(st)) {
-            return translate_status(f->ad, st);
-        }
+    if (keep) {
+        pthread_mutex_lock(&f->ad->lock);
+        f->retained = ktime();
+        vector_push(f->ad->retained, f);
+        pthread_cond_signal(&f->ad->retaining);
+        pthread_mutex_unlock(&f->ad->lock);
     }
     f->eFileLock = eFileLock;
     return SQLITE_OK;
@@ -356,8 +598,11 @@ static int nfs4FileControl(sqlite3_file *pFile, int op, void *pArg)
         return SQLITE_NOTFOUND;
     }
     
+    // hands back the old limit, a negative one is just a query
     if (op == SQLITE_FCNTL_MMAP_SIZE) {
-        *(u64 *) pArg = 0;
+        sqlite3_int64 limit = *(sqlite3_int64 *)pArg;
+        *(sqlite3_int64 *)pArg = f->mmap_size;
+        if (limit >= 0) f->mmap_size = limit;
     }
     
     if( op==SQLITE_FCNTL_VFSNAME ){
@@ -386,52 +631,329 @@ static int nfs4DeviceCharacteristics(sqlite3_file *pFile){
 
 }
 
+// by default the wal-index lives in process memory, so it can only be
+// shared by a single connection. everyone else is kept out with a write
+// lock on a byte past the sqlite lock range, held from the first map
+// until unmap
+#define SHM_BYTE (SHARED_FIRST+SHARED_SIZE)
+
+// with NFS_SHM_FILE the index is also kept in a -shm file next to the
+// database, and the index locks are byte range locks on that file at
+// the same offsets as os_unix.c uses. every host has a private copy of
+// the regions, and a shadow of what the server had when we last looked.
+// bytes which differ from the shadow were changed under one of our
+// exclusive locks and are written back when it's released. the rest is
+// refreshed whenever the change attribute moves
+#define SHM_LOCK_BASE 120
+#define SHM_DMS (SHM_LOCK_BASE+SQLITE_SHM_NLOCK)
+
+static boolean same_file(file a, file b)
+{
+    buffer x = filename(a), y = filename(b);
+    boolean result = (length(x) == length(y)) &&
+        !memcmp(x->contents + x->start, y->contents + y->start, length(x));
+    deallocate_buffer(x);
+    deallocate_buffer(y);
+    return result;
+}
+
+static vector shm_path(sqlfile f)
+{
+    vector p = allocate_vector(f->h, vector_length(f->path));
+    int n = vector_length(f->path);
+    for (int i = 0; i < n - 1; i++)
+        vector_push(p, vector_get(f->path, i));
+    buffer last = vector_get(f->path, n - 1);
+    buffer b = allocate_buffer(f->h, length(last) + 4);
+    buffer_concat(b, last);
+    push_bytes(b, "-shm", 4);
+    vector_push(p, b);
+    return p;
+}
+
+static int shm_open_file(sqlfile f)
+{
+    status st = file_create(f->c, shm_path(f), &f->shmf);
+    if (is_ok(st)) {
+        // the first host in clears out anything left by one that died
+        if (is_ok(lock_range(f->shmf, WRITE_LT, SHM_DMS, 1)))
+            st = file_truncate(f->shmf, 0);
+        // and everyone holds it shared until they're done
+        if (is_ok(st)) st = lock_range(f->shmf, READ_LT, SHM_DMS, 1);
+    }
+    if (!is_ok(st)) {
+        translate_status(f->ad, st);
+        file_close(f->shmf);
+        f->shmf = 0;
+        return SQLITE_BUSY;
+    }
+    f->shm_change = 0;
+    f->shm_exclusive = 0;
+    f->shm_current = false;
+    f->shadow = allocate_vector(f->h, 4);
+    return SQLITE_OK;
+}
+
+// the server side of attaching, either the -shm file or the lock that
+// keeps other hosts off the in-memory index
+static int shm_take(sqlfile f)
+{
+    if (f->ad->shm_file) return shm_open_file(f);
+    status st = lock_range(f->f, WRITE_LT, SHM_BYTE, 1);
+    if (!is_ok(st)) {
+        translate_status(f->ad, st);
+        return SQLITE_BUSY;
+    }
+    return SQLITE_OK;
+}
+
+// two threads can't both get in for the same file. the place in the
+// list is taken first, so the server isn't asked with the lock held
+static int shm_attach(sqlfile f)
+{
+    sqlfile i;
+    pthread_mutex_lock(&f->ad->lock);
+    // nfs locks are per client, so they don't separate connections in this process
+    vector_foreach(i, f->ad->shm) {
+        if (same_file(i->f, f->f)) {
+            pthread_mutex_unlock(&f->ad->lock);
+            return SQLITE_BUSY;
+        }
+    }
+    vector_push(f->ad->shm, f);
+    pthread_mutex_unlock(&f->ad->lock);
+
+    int rc = shm_take(f);
+    if (rc != SQLITE_OK) {
+        pthread_mutex_lock(&f->ad->lock);
+        vector_remove(f->ad->shm, f);
+        pthread_mutex_unlock(&f->ad->lock);
+        return rc;
+    }
+    f->shm = allocate_vector(f->h, 4);
+    return SQLITE_OK;
+}
+
+// take whatever the server has for the bytes we haven't changed
+static void shm_merge(sqlfile f, int i, u8 *server)
+{
+    u8 *region = vector_get(f->shm, i);
+    u8 *shadow = vector_get(f->shadow, i);
+    for (int j = 0; j < f->shm_size; j++) {
+        if (region[j] == shadow[j]) region[j] = server[j];
+        shadow[j] = server[j];
+    }
+}
+
+static status shm_pull(sqlfile f)
+{
+    u64 change;
+    status st = file_change(f->shmf, &change);
+    if (!is_ok(st) || (change == f->shm_change)) return st;
+
+    u8 *server = allocate(0, f->shm_size);
+    for (int i = 0; is_ok(st) && (i < vector_length(f->shm)); i++) {
+        st = readfile(f->shmf, server, (u64)i * f->shm_size, f->shm_size);
+        if (is_ok(st)) shm_merge(f, i, server);
+    }
+    deallocate(0, server, f->shm_size);
+    // our own pushes move it too, so this is only ever a hint
+    if (is_ok(st)) f->shm_change = change;
+    return st;
+}
+
+// only the runs that changed, so bytes under someone else's lock
+// aren't stepped on
+static status shm_push(sqlfile f)
+{
+    for (int i = 0; i < vector_length(f->shm); i++) {
+        u8 *region = vector_get(f->shm, i);
+        u8 *shadow = vector_get(f->shadow, i);
+        u64 base = (u64)i * f->shm_size;
+        for (int j = 0; j < f->shm_size; ) {
+            if (region[j] == shadow[j]) {
+                j++;
+                continue;
+            }
+            int k = j;
+            while ((k < f->shm_size) && (region[k] != shadow[k])) k++;
+            memcpy(shadow + j, region + j, k - j);
+            // nothing commits the index, it's rebuilt from the wal after
+            // a crash, so it isn't held for write-behind either
+            status st = writefile(f->shmf, region + j, base + j, k - j, SYNCH_COMMIT);
+            if (!is_ok(st)) return st;
+            j = k;
+        }
+    }
+    return STATUS_OK;
+}
+
 static int nfs4ShmMap(sqlite3_file *pFile, int iPg, int pgsz, int bExtend, void volatile  **pp)
 {
     sqlfile f = (sqlfile)(void *)pFile;
-    // jss - probably ok to leave this as a noop rather than forwarding to the
-    // parent VFS since there is no shared memory support.
     if (f->ad->trace) 
-        eprintf ("shmap %s\n", f->filename);
-    return SQLITE_READONLY;
-}
+        eprintf ("shmap %s %d\n", f->filename, iPg);
+
+    if (!f->shm) {
+        int rc = shm_attach(f);
+        if (rc != SQLITE_OK) return rc;
+        f->shm_size = pgsz;
+    }
 
+    boolean grown = false;
+    while (vector_length(f->shm) <= iPg) {
+        u64 end = (u64)vector_length(f->shm) * f->shm_size;
+        if (!bExtend) {
+            // someone else may have grown it
+            u64 size = 0;
+            if (f->shmf && !is_ok(file_size(f->shmf, &size)))
+                return SQLITE_IOERR_SHMMAP;
+            if (size <= end) {
+                *pp = 0;
+                return SQLITE_OK;
+            }
+        }
+        void *region = allocate(0, f->shm_size);
+        if (!region) return SQLITE_NOMEM;
+        memset(region, 0, f->shm_size);
+        vector_push(f->shm, region);
+        if (f->shmf) {
+            u8 *shadow = allocate(0, f->shm_size);
+            if (!shadow) return SQLITE_NOMEM;
+            memset(shadow, 0, f->shm_size);
+            vector_push(f->shadow, shadow);
+            if (!is_ok(readfile(f->shmf, shadow, end, f->shm_size)))
+                return SQLITE_IOERR_SHMMAP;
+            memcpy(region, shadow, f->shm_size);
+            grown = true;
+        }
+    }
+    // so a host that only maps what's there can find it. sqlite only
+    // extends under the wal write lock, so nobody else is growing it
+    if (grown && bExtend) {
+        u64 size, want = (u64)vector_length(f->shm) * f->shm_size;
+        status st = file_size(f->shmf, &size);
+        if (is_ok(st) && (size < want)) st = file_truncate(f->shmf, want);
+        if (!is_ok(st)) {
+            translate_status(f->ad, st);
+            return SQLITE_IOERR_SHMMAP;
+        }
+    }
+    *pp = vector_get(f->shm, iPg);
+    return SQLITE_OK;
+}
 
+// in memory there's only ever one connection on the index, and it
+// can't conflict with itself
 static int nfs4ShmLock(sqlite3_file *pFile, int offset, int n, int flags){
     sqlfile f = (sqlfile)(void *)pFile;
     if (f->ad->trace) 
-        eprintf ("shm lock %s\n", ((sqlfile)pFile)->filename);
-    return SQLITE_READONLY;
+        eprintf ("shm lock %s %d %d %x\n", ((sqlfile)pFile)->filename, offset, n, flags);
+    if (!f->shmf) return SQLITE_OK;
+
+    u8 mask = ((1 << n) - 1) << offset;
+    u32 type = (flags & SQLITE_SHM_EXCLUSIVE) ? WRITE_LT : READ_LT;
+    status st;
+    f->shm_current = false;
+    if (flags & SQLITE_SHM_UNLOCK) {
+        if (f->shm_exclusive & mask) {
+            st = shm_push(f);
+            if (!is_ok(st)) {
+                translate_status(f->ad, st);
+                return SQLITE_IOERR_SHMLOCK;
+            }
+            f->shm_exclusive &= ~mask;
+        }
+        st = unlock_range(f->shmf, type, SHM_LOCK_BASE + offset, n);
+        if (!is_ok(st)) {
+            translate_status(f->ad, st);
+            return SQLITE_IOERR_SHMLOCK;
+        }
+        return SQLITE_OK;
+    }
+
+    st = lock_range(f->shmf, type, SHM_LOCK_BASE + offset, n);
+    if (!is_ok(st)) {
+        translate_status(f->ad, st);
+        return SQLITE_BUSY;
+    }
+    if (type == WRITE_LT) f->shm_exclusive |= mask;
+    // whoever held it last has pushed their changes
+    st = shm_pull(f);
+    if (!is_ok(st)) {
+        translate_status(f->ad, st);
+        return SQLITE_IOERR_SHMLOCK;
+    }
+    f->shm_current = true;
+    return SQLITE_OK;
 }
 
+// readers look at the index header without a lock, so this is where
+// they pick up another hosts commits. while we hold something
+// exclusive we're the one writing. sqlite asks for several in a row
+// when it reads the header, only the first after a lock change goes
+// to the server
 static void nfs4ShmBarrier(sqlite3_file *pFile){
     sqlfile f = (sqlfile)(void *)pFile;
     if (f->ad->trace) 
         eprintf ("shm barrier %s\n", f->filename);
-    return;
+    __sync_synchronize();
+    if (!f->shmf || f->shm_exclusive || f->shm_current) return;
+    f->shm_current = is_ok(shm_pull(f));
 }
 
 
+// the index is rebuilt from the wal by whoever maps it first, so
+// deleteFlag doesn't change anything
 static int nfs4ShmUnmap(sqlite3_file *pFile, int deleteFlag){
     sqlfile f = (sqlfile)(void *)pFile;
     if (f->ad->trace) 
         eprintf ("shm unmap %s\n", f->filename);
-    return SQLITE_OK;
+    if (!f->shm) return SQLITE_OK;
+
+    void *region;
+    vector_foreach(region, f->shm)
+        deallocate(0, region, f->shm_size);
+    f->shm = 0;
+    pthread_mutex_lock(&f->ad->lock);
+    vector_remove(f->ad->shm, f);
+    pthread_mutex_unlock(&f->ad->lock);
+
+    if (f->shmf) {
+        vector_foreach(region, f->shadow)
+            deallocate(0, region, f->shm_size);
+        status st = unlock_range(f->shmf, READ_LT, SHM_DMS, 1);
+        status cs = file_close(f->shmf);
+        if (is_ok(st)) st = cs;
+        f->shmf = 0;
+        return translate_status(f->ad, st);
+    }
+    return translate_status(f->ad, unlock_range(f->f, WRITE_LT, SHM_BYTE, 1));
 }
 
+// pages come out of the client page cache (NFS_CACHE_PAGES), so this
+// only does anything with it on. a zero page sends sqlite to xRead
 static int nfs4Fetch(sqlite3_file *pFile,  sqlite3_int64 iOfst, int iAmt, void **pp)
 {
     sqlfile f = (sqlfile)(void *)pFile;
     if (f->ad->trace) 
-        eprintf ("fetch %s\n", f->filename);
-    translate_status(f->ad, readfile(f->f, *pp, iOfst, iAmt));
+        eprintf ("fetch %s %lld %d ", f->filename, iOfst, iAmt);
+    *pp = 0;
+    if (iOfst + iAmt > f->mmap_size) {
+        if (f->ad->trace) eprintf ("past mmap_size\n");
+        return SQLITE_OK;
+    }
+    return translate_status(f->ad, fetchfile(f->f, iOfst, iAmt, pp));
 }
  
+// a zero page is sqlite asking for everything to be unmapped, which
+// it only does once nothing is fetched
 static int nfs4Unfetch(sqlite3_file *pFile, sqlite3_int64 iOfst, void *pPage)
 {
     sqlfile f = (sqlfile)(void *)pFile;
     if (f->ad->trace) 
         eprintf ("unfetch %s\n", f->filename);
+    if (pPage) unfetchfile(f->f, iOfst, pPage);
     return SQLITE_OK;
 }
 
@@ -471,6 +993,11 @@ static int nfs4Open(sqlite3_vfs *pVfs,
     
     f->ad = ad;
     f->eFileLock = NO_LOCK;
+    f->shm = 0;
+    f->shmf = 0;
+    f->mmap_size = 0;
+    f->retained = 0;
+    f->releasing = false;
     f->powersafe = true;
     f->readonly = false;
 
@@ -479,43 +1006,40 @@ static int nfs4Open(sqlite3_vfs *pVfs,
         memcpy(f->filename, zName, strlen(zName));
     }
 
-    struct buffer znb;
-    buffer_wrap_string(&znb, (char *)zName);
-    vector path = split(0, &znb, '/');
-    buffer servername = vector_pop(path);
-    buffer zeg =  vector_get(path, 0);
-    push_char(servername, 0);
-
-#ifndef NFS4_CLIENT_PER_FILEHANDLE
-    client *c = &ad->c;
-#else
-    client lc = 0;
-    client *c = &lc;
-#endif
-
-    if (*c == 0) {
-        // change interface to tuple in order to parameterize
-        status st = create_client((char *)servername->contents, c);
-        if (!is_ok(st)) {
-            return translate_status(ad, st);
-        }
-    }
-    
-    f->base.pMethods = methods;
+    buffer servername;
+    f->h = allocate_arena(0, 1024);
+    vector path = split_name(f->h, zName, &servername);
 
-    if (flags & SQLITE_OPEN_READONLY) {
-        return translate_status(ad, file_open_read(*c, path, &f->f));
-    }
-    
-    if (flags & SQLITE_OPEN_CREATE) {
-        return translate_status(ad, file_create(*c, path, &f->f));
+    status st = borrow_session(ad, servername, true, &f->s);
+    if (!is_ok(st)) {
+        destroy(f->h);
+        return translate_status(ad, st);
     }
+    client c = f->c = f->s->c;
+    f->path = path;
     
-    if (flags & SQLITE_OPEN_READWRITE) {
-        return translate_status(ad, file_open_write(*c, path, &f->f));
+    if (flags & SQLITE_OPEN_READONLY) {
+        st = file_open_read(c, path, &f->f);
+    } else if (flags & SQLITE_OPEN_CREATE) {
+        st = file_create(c, path, &f->f);
+    } else if (flags & SQLITE_OPEN_READWRITE) {
+        st = file_open_write(c, path, &f->f);
+    } else {
+        return_session(f->ad, f->s);
+        destroy(f->h);
+        return SQLITE_CANTOPEN;
     }
 
-    return SQLITE_CANTOPEN;
+    // sqlite doesn't close a file that failed to open
+    if (!is_ok(st)) {
+        file_close(f->f);
+        return_session(f->ad, f->s);
+        destroy(f->h);
+        f->base.pMethods = 0;
+    } else {
+        f->base.pMethods = methods;
+    }
+    return translate_status(ad, st);
 }
 
 static int nfs4Delete(sqlite3_vfs *pVfs, const char *zPath, int dirSync)
@@ -526,11 +1050,15 @@ static int nfs4Delete(sqlite3_vfs *pVfs, const char *zPath, int dirSync)
     
     // note - its not clear if there is an appropriate nfs4 implmentation of 
     // dirSync, and it might affect consistency at least probibalistically
-    struct buffer znb;
-    buffer_wrap_string(&znb, (char *)zPath);
-    vector path = split(0, &znb, '/');
-    vector_pop(path);
-    delete(ad->c, path);    // xxx ad->c may be unitialized
+    buffer server;
+    session s;
+    heap h = allocate_arena(0, 1024);
+    vector path = split_name(h, zPath, &server);
+    if (is_ok(borrow_session(ad, server, false, &s))) {
+        delete(s->c, path);
+        return_session(ad, s);
+    }
+    destroy(h);
         
     return SQLITE_OK;
 }
@@ -548,12 +1076,17 @@ static int nfs4Access(sqlite3_vfs *pVfs,
     /* The spec says there are three possible values for flags.  But only
     ** two of them are actually used */
     if( flags==SQLITE_ACCESS_EXISTS ){
-        struct buffer znb;
-        buffer_wrap_string(&znb, (char *)zPath);
-        vector path = split(0, &znb, '/');
-        vector_pop(path);
-        status s = exists(ad->c, path);    // xxx ad->c may be unitialized
-        *pResOut = is_ok(s)?1:0;
+        buffer server;
+        session s;
+        heap h = allocate_arena(0, 1024);
+        vector path = split_name(h, zPath, &server);
+        status st = borrow_session(ad, server, false, &s);
+        if (is_ok(st)) {
+            st = exists(s->c, path);
+            return_session(ad, s);
+        }
+        *pResOut = is_ok(st)?1:0;
+        destroy(h);
     }
     if( flags==SQLITE_ACCESS_READWRITE ){
         *pResOut = 1;
@@ -665,8 +1198,22 @@ int sqlite3_nfs_init(sqlite3 *db,
     appd ad = allocate(0, sizeof(struct appd));
     nfs4_vfs.pAppData = ad;
     ad->parent = sqlite3_vfs_find(0);
-    ad->c = 0;
+    ad->hosts = allocate_vector(0, 2);
+    ad->session_limit = MAX(config_u64("NFS_SESSIONS", 1), 1);
+    ad->session_idle = config_u64("NFS_SESSION_IDLE", 300) << 32;
+    ad->shm = allocate_vector(0, 4);
     ad->trace = config_boolean("NFS_TRACE", false);
+    ad->shm_file = config_boolean("NFS_SHM_FILE", false);
+    ad->lazy_unlock = config_u64("NFS_LAZY_UNLOCK", 0) * (1ull<<32) / 1000;
+    ad->retained = allocate_vector(0, 4);
+    pthread_cond_init(&ad->retaining, 0);
+    pthread_cond_init(&ad->released, 0);
+    pthread_mutex_init(&ad->lock, 0);
+    pthread_t t;
+    if (ad->lazy_unlock && !pthread_create(&t, 0, reaper, ad))
+        pthread_detach(t);
+    if (config_string("NFS_HOSTS", 0) && !pthread_create(&t, 0, preconnect, ad))
+        pthread_detach(t);
     nfs4_vfs.pNext = sqlite3_vfs_find(0);
     nfs4_vfs.szOsFile = sizeof(struct sqlfile);
     methods = &nfs4_io_methods;
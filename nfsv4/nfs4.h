@@ -4,18 +4,70 @@ typedef struct file *file;
 typedef struct client *client;
 
 status create_client(char *hostname, client *dest);
+// every file has to be closed first
+void client_destroy(client c);
 
 status file_open_read(client c, vector path, file *x);
 status file_open_write(client c, vector path, file *x);
 status file_create(client c, vector path, file *x);
-void file_close(file f);
+status file_close(file f); // fails if held writes couldn't be committed
+status file_sync(file f); // commit anything written with SYNCH_LOCAL or SYNCH_REMOTE
 status file_size(file f, u64 *s); // should be path instead of requiring an open file?
+status file_truncate(file f, u64 length);
+status file_change(file f, u64 *c); // differs whenever the contents have
 status writefile(file f, void *source, u64 offset, u32 length, u32 synch);
 status readfile(file f, void *dest, u64 offset, u32 length);
+// a pointer into the client's page cache, or zero if the range isn't
+// one page or pages can't be trusted. it stays valid until unfetchfile
+status fetchfile(file f, u64 offset, u32 length, void **dest);
+void unfetchfile(file f, u64 offset, void *x);
 buffer filename(file f);
 status lock_range(file f, u32 locktype, u64 offset, u64 length);
 status unlock_range(file f, u32 locktype, u64 offset, u64 length);
 
+// lock changes sent together in one compound and applied in order.
+// it stops at the first failure, done is the number that took effect
+typedef struct lock_step {
+    boolean unlock;
+    u32 locktype;
+    u64 offset, length;
+} *lock_step;
+status lock_steps(file f, lock_step steps, int count, int *done);
+
+// asynchronous variants for callers with their own event loop. the
+// operation is started right away, or once a session slot frees up, and
+// its completion is called from client_process. the caller's buffer has
+// to stay put until then. if nothing needs to be sent the completion
+// runs before returning, and if an error is returned it never runs.
+// they see the page cache and held writes like the synchronous ones, a
+// write first sends anything held and then goes straight to the server.
+// file_close waits for the ones on the file to finish
+typedef void (*completion)(void *a, status s);
+status readfile_async(file f, void *dest, u64 offset, u32 length, completion k, void *a);
+status writefile_async(file f, void *source, u64 offset, u32 length, completion k, void *a);
+status lock_range_async(file f, u32 locktype, u64 offset, u64 length, completion k, void *a);
+status unlock_range_async(file f, u32 locktype, u64 offset, u64 length, completion k, void *a);
+// readable when client_process has work to do
+int client_fd(client c);
+status client_process(client c);
+
+// independent operations on any number of open files, packed into as
+// few compounds as the session allows. nothing goes out until batch_flush,
+// which returns the first error. operations after a failure may not run,
+// batch_status says which did
+typedef struct batch *batch;
+batch allocate_batch(client c);
+void batch_read(batch b, file f, void *dest, u64 offset, u32 length);
+void batch_write(batch b, file f, void *source, u64 offset, u32 length);
+void batch_size(batch b, file f, u64 *size);
+void batch_lock(batch b, file f, u32 locktype, u64 offset, u64 length);
+void batch_unlock(batch b, file f, u32 locktype, u64 offset, u64 length);
+// where batch_flush leaves the outcome of the operation queued last.
+// it's "not run" until that's known
+void batch_status(batch b, status *s);
+status batch_flush(batch b);
+void deallocate_batch(batch b);
+
 status exists(client c, vector path);
 status delete(client c, vector path);
 status readdir(client c, vector path, vector result);
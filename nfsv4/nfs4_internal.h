@@ -5,29 +5,173 @@
 #include <nfs4xdr.h>
 #include <config.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <endian.h>
 
-struct client {
+typedef struct rpc *rpc;
+
+// per-slot state for the session's forward channel - 2.10.6
+typedef struct slot {
+    u32 sequence;
+    rpc r; // in flight on this slot, or zero
+} *slot;
+
+// one of the tcp connections the session is trunked over
+typedef struct connection {
+    client c;
     int fd;
+    void *transport_state;
+    u64 zerocopy_sent;
+    u64 zerocopy_done;
+} *connection;
+
+// socket io for a connection, selected with NFS_TRANSPORT. reads and writes
+// are all or nothing and return the byte count or -1. attach, detach,
+// buffered, flush and release may be zero
+typedef struct transport {
+    char *name;
+    status (*attach)(connection n); // after connect
+    void (*detach)(connection n); // before close
+    int (*readv)(connection n, struct iovec *v, int count);
+    int (*writev)(connection n, struct iovec *v, int count, int flags);
+    boolean (*buffered)(connection n); // input has already been read off the socket
+    status (*flush)(client c); // push any queued writes to the kernel
+    void (*release)(client c); // once every connection is closed for good
+} *transport;
+
+extern struct transport socket_transport;
+extern struct transport uring_transport;
+
+// offsets into an encoded call
+#define RPC_XID_OFFSET 4 // after the record mark
+// op, session id, then sequenceid, slotid, highest slotid and cachethis
+#define SEQUENCE_TEMPLATE (4 + NFS4_SESSIONID_SIZE + 16)
+#define SEQUENCE_SLOT_OFFSET (4 + NFS4_SESSIONID_SIZE)
+
+// client.bootstrap
+#define BOOTSTRAP_DONE 0
+#define BOOTSTRAP_OWED 1 // goes out with the next open
+#define BOOTSTRAP_SENT 2 // on an open in flight
+
+struct client {
+    transport t;
+    void *transport_state;
+    vector connections;
+    u32 bound; // connections[0..bound) are associated with the session
+    u32 next_connection;
     heap h;
     u32 xid;
     u32 address;
     u64 clientid;
     u8 session[NFS4_SESSIONID_SIZE];
-    u32 sequence;
+    buffer header; // rpc and compound header up to the opcount, see rpc_templates
+    u8 sequence[SEQUENCE_TEMPLATE]; // SEQUENCE op for the current session
+    struct slot *slots; // maxreqs entries
+    u32 slot_limit; // server target_highest_slotid + 1
+    vector pending; // rpcs sent and awaiting a reply, demuxed by xid
+    vector completed; // replies for rpcs with completions, run by client_process
+    vector waiting; // asynchronous operations waiting for a free slot
+    boolean processing; // inside client_process
+    int epoll; // the fd from client_fd, or -1
+    int wakeup; // eventfd in the epoll set
     u32 server_sequence;
     u32 lock_sequence;
     u8 instance_verifier[NFS4_VERIFIER_SIZE];
-    buffer forward;
-    buffer reverse; 
     bytes maxreq;
     bytes maxresp;
     u32 maxops;
     u32 maxreqs;
+    u32 io_depth; // chunks of a single large read or write in flight at once
+    u32 zerocopy; // smallest payload sent with MSG_ZEROCOPY, zero for never
+    u64 write_behind; // NFS_WRITE_BEHIND, zero for off
     buffer hostname;
     u8 root_filehandle_len;
     u8 root_filehandle[NFS4_FHSIZE];
+    vector fhcache; // directory filehandles, see fhcache.c
+    boolean fhcache_dirty; // not written to NFS_FH_CACHE yet
+    heap rpcs; // freelist of struct rpc
+    heap operations; // for async.c
+    heap compounds; // freelist for batch_flush
+    vector spare; // buffers kept by put_buffer
+    struct page_cache *cache; // see cache.c, zero if its off
+    u32 delegation_epoch; // delegations from before this are gone
+    ticks rtt; // estimates for sizing readahead, see readahead.c
+    u64 bandwidth; // bytes per second
+    u32 lease; // seconds, from the server
+    ticks renewed; // last successful SEQUENCE
+    u8 bootstrap; // what's left of session setup, see push_bootstrap
+    boolean receiving; // a thread is reading replies, see receive_reply
+    boolean connecting; // a new session is being set up, see rpc_connection
+    u32 generation; // sessions set up so far
+    boolean keepalive_running; // the keepalive thread is there to join
+    pthread_t keepalive;
+    boolean stopping; // client_destroy was called
+    pthread_cond_t stop; // wakes keepalive for client_destroy
+    // held for the length of each request, and let go while waiting for
+    // a reply so other threads can send theirs. it counts its own depth,
+    // since recovery calls back into transact and a wait has to let go
+    // of all of it
+    pthread_mutex_t lock;
+    pthread_t owner;
+    u32 depth;
+    pthread_cond_t received; // a reply came in, or the reader stepped aside
 };
 
+// owner is only trusted while depth is set, and a thread only ever
+// finds itself there if it stored it
+static inline void client_lock(client c)
+{
+    u32 depth = __atomic_load_n(&c->depth, __ATOMIC_ACQUIRE);
+    if (depth && pthread_equal(__atomic_load_n(&c->owner, __ATOMIC_RELAXED), pthread_self())) {
+        __atomic_store_n(&c->depth, depth + 1, __ATOMIC_RELEASE);
+        return;
+    }
+    pthread_mutex_lock(&c->lock);
+    __atomic_store_n(&c->owner, pthread_self(), __ATOMIC_RELAXED);
+    __atomic_store_n(&c->depth, 1, __ATOMIC_RELEASE);
+}
+
+static inline void client_unlock(client c)
+{
+    u32 depth = __atomic_load_n(&c->depth, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&c->depth, depth, __ATOMIC_RELEASE);
+    if (!depth) pthread_mutex_unlock(&c->lock);
+}
+
+// let go entirely around a blocking read, returns what to take back
+static inline u32 client_release(client c)
+{
+    u32 depth = __atomic_load_n(&c->depth, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->depth, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&c->lock);
+    return depth;
+}
+
+static inline void client_reacquire(client c, u32 depth)
+{
+    pthread_mutex_lock(&c->lock);
+    __atomic_store_n(&c->owner, pthread_self(), __ATOMIC_RELAXED);
+    __atomic_store_n(&c->depth, depth, __ATOMIC_RELEASE);
+}
+
+// until received is signalled, with the lock let go meanwhile
+static inline void client_wait(client c)
+{
+    u32 depth = __atomic_load_n(&c->depth, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->depth, 0, __ATOMIC_RELEASE);
+    pthread_cond_wait(&c->received, &c->lock);
+    __atomic_store_n(&c->owner, pthread_self(), __ATOMIC_RELAXED);
+    __atomic_store_n(&c->depth, depth, __ATOMIC_RELEASE);
+}
+
+// threads waiting on another's bootstrap sleep in client_wait
+static inline void set_bootstrap(client c, u8 state)
+{
+    c->bootstrap = state;
+    pthread_cond_broadcast(&c->received);
+}
+
 typedef struct  stateid {
     u32 sequence;
     u8 opaque [NFS4_OTHER_SIZE];
@@ -40,6 +184,20 @@ struct file {
     u8 filehandle[NFS4_FHSIZE];
     struct stateid latest_sid;
     struct stateid open_sid;
+    struct stateid lock_sid; // valid once lock_owner is set
+    boolean lock_owner; // the server knows our lock owner on this file
+    u32 lock_generation; // client generation lock_sid came from
+    struct stateid delegation;
+    u32 delegation_type; // OPEN_DELEGATE_NONE if there isn't one
+    u32 delegation_epoch;
+    boolean validated; // cached pages were checked when the lock was taken
+    struct readahead *ra; // zero until its been read
+    vector extents; // write-behind, see writebehind.c
+    u64 buffered; // bytes in extents
+    u8 verifier[NFS4_VERIFIER_SIZE]; // from unstable writes since the last commit
+    boolean verifier_set;
+    boolean verifier_changed; // the server restarted, unstable writes may be gone
+    u32 operations; // async ones not finished yet, see drain_operations
 };
 
 static inline void push_boolean(buffer b, boolean x)
@@ -62,33 +220,86 @@ static inline void push_be64(buffer b, u64 w) {
     b->end += 8;
 }
 
+// memcpy so that unaligned loads are fine, it compiles to a single load
 #define read_beu32(__c, __b) ({\
     if ((__b->end - __b->start) < 4 ) return allocate_status(__c, "out of data"); \
-    u32 v = ntohl(*(u32*)(__b->contents + __b->start));\
+    u32 v;\
+    memcpy(&v, __b->contents + __b->start, 4);\
     __b->start += 4;\
-    v;})
+    be32toh(v);})
 
 #define read_beu64(__c, __b) ({\
     if ((__b->end - __b->start) < 8 ) return allocate_status(__c, "out of data");\
-    u64 v = ntohl(*(u32*)(__b->contents + __b->start));\
-    u64 v2 = ntohl(*(u32*)(__b->contents + __b->start + 4));    \
-    __b->start += 8;                                        \
-    v<<32 | v2;})
+    u64 v;\
+    memcpy(&v, __b->contents + __b->start, 8);\
+    __b->start += 8;\
+    be64toh(v);})
 
-typedef struct rpc *rpc;
 rpc allocate_rpc(client s, buffer b);
 
 struct status {
     char *cause;
-    file f;
 };
     
+// caller data spliced into the request at offset in b
+struct fragment {
+    bytes offset;
+    void *data;
+    u32 length;
+};
+
+#define RPC_FRAGMENTS 16
+
 struct rpc {
     client c;
+    file f; // zero if not a file operation
+    connection n; // the call went out on, zero until sent
+    u32 xid;
     bytes opcountloc;
+    bytes sequenceloc; // zero if there is no SEQUENCE op, patched on send
+    u32 slot;
     int opcount;
     buffer b;
-    vector completions;
+    buffer result;
+    boolean owned; // b and result are from get_buffer, see allocate_rpc
+    boolean bootstrap; // carries the end of session setup, until it's parsed
+    u32 nstatus; // the compound's, see parse_rpc
+    u32 following; // results left to read, see next_result
+    void *data; // caller's buffer for a READ or WRITE payload
+    u32 data_length;
+    bytes reply_header; // nonzero if the reply ends with a payload for data
+    boolean delivered; // the payload was received directly into data
+    struct fragment fragments[RPC_FRAGMENTS];
+    int fragment_count;
+    boolean complete;
+    vector completions; // callbacks, run from client_process
+    vector fill; // the path of a directory GETFH for the filehandle cache
+    int fill_depth;
+};
+
+// fixed reply sizes, including the xid but not the framer
+#define RPC_REPLY_HEADER (6 * 4 + 3 * 4) // rpc reply, compound status, tag, opcount
+#define SEQUENCE_REPLY (2 * 4 + NFS4_SESSIONID_SIZE + 5 * 4)
+#define EMPTY_OP_REPLY (2 * 4) // op and status only, i.e. PUTFH or LOOKUP
+#define READ_REPLY_HEADER (2 * 4 + 2 * 4) // op, status, eof, count
+
+// an operation queued on a batch, see batch_flush
+typedef struct batch_entry {
+    file f;
+    u32 op;
+    void *data;
+    u64 offset;
+    u64 length;
+    u32 locktype;
+    u64 *size;
+    u32 stable; // for writes
+    status *result; // see batch_status
+} *batch_entry;
+
+struct batch {
+    client c;
+    vector entries;
+    int last; // the first entry of the operation queued last
 };
 
 // consider pulling in proper closures 
@@ -105,6 +316,8 @@ static inline void push_op(rpc r, u32 op)
 }
 
 void push_sequence(rpc r);
+status push_bootstrap(rpc r, int following);
+void rpc_templates(client c);
 void push_bare_sequence(rpc r);
 void push_lock_sequence(rpc r);
 
@@ -122,34 +335,108 @@ void push_create_session(rpc r);
 status parse_create_session(client, buffer);
 void push_lookup(rpc r, buffer i);
 buffer filename(file f);
-status parse_rpc(client s, buffer b, boolean *badsession);
+status parse_rpc(rpc r, buffer b, boolean *badsession);
+status next_result(rpc r, buffer b, u32 *op);
 void push_open(rpc r, buffer name, u32 share_access, boolean create);
 status parse_open(file f, buffer b);
 status parse_stateid(client c, buffer b, stateid sid);
+status lock_stateid(file f, buffer b);
+
+struct nfstime {
+    u64 seconds; // signed on the wire
+    u32 nseconds;
+};
+
+// the attributes we know how to decode. mask has a bit for each one
+// that was present, by FATTR4_ number
+typedef struct fattr {
+    u64 mask;
+    u32 type;
+    u64 change;
+    u64 size;
+    u32 lease_time;
+    u64 fileid;
+    u32 mode;
+    u32 numlinks;
+    u64 space_used;
+    struct nfstime modify;
+} *fattr;
+
+status skip_result(client c, buffer b, u32 op);
+status parse_fattr(client c, buffer b, fattr a);
+void push_fattr(buffer b, fattr a);
+void push_attr_request(rpc r, u64 mask);
 void push_string(buffer b, char *x, u32 length);
+void push_fragment(rpc r, void *x, u32 length);
+status zerocopy_wait(client c);
 
 
-status segment(status (*each)(file, void *, u64, u32), int chunksize, file f, void *x, u64 offset, u32 length);
+status segment(rpc (*start)(file, buffer, void *, u64, u32),
+               status (*complete)(rpc),
+               int op, int chunksize, file f, void *x, u64 offset, u32 length);
 buffer push_initial_path(rpc r, vector path);
 status transact(rpc r, int op, buffer b);
+status rpc_send(rpc r);
+status rpc_wait(rpc r);
+status receive_reply(client c);
+status read_reply(connection n);
+connection ready(client c, int timeout);
+void abort_pending(client c);
+boolean slot_available(client c);
+status parse_reply(rpc r, int op, buffer result, boolean *badsession);
+void client_wakeup(client c);
+
+rpc write_chunk(file f, buffer b, void *source, u64 offset, u32 length);
+status write_chunk_complete(rpc r);
+rpc read_chunk(file f, buffer b, void *dest, u64 offset, u32 length);
+status read_chunk_complete(rpc r);
+rpc lock_rpc(file f, buffer b, u32 locktype, u64 offset, u64 length);
+rpc unlock_rpc(file f, buffer b, u32 locktype, u64 offset, u64 length);
+status lock_complete(rpc r);
+status unlock_complete(rpc r);
+status return_delegation(file f);
 
-status write_chunk(file f, void *source, u64 offset, u32 length);
-status read_chunk(file f, void *source, u64 offset, u32 length);
+void cache_init(client c);
+boolean cache_read(file f, void *dest, u64 offset, u32 length);
+void cache_fill(file f, void *source, u64 offset, u32 length);
+void cache_update(file f, void *source, u64 offset, u32 length);
+void cache_revalidate(file f, u64 change);
+void cache_invalidate(file f);
+status read_uncached(file f, void *dest, u64 offset, u32 length);
+status parse_change(file f, buffer b);
+
+void measure_read(client c, u32 length, ticks t);
+boolean readahead_read(file f, void *dest, u64 offset, u32 length, status *s);
+void readahead_after(file f, u64 offset, u32 length);
+void readahead_drop(file f);
+void readahead_close(file f);
+status read_async(file f, void *dest, u64 offset, u32 length, completion k, void *a);
+void drain_operations(file f);
+
+void batch_write_unstable(batch bt, file f, void *source, u64 offset, u32 length);
+status commit(file f, u8 *verifier);
+void write_verifier(file f, u8 *verifier);
+status write_behind(file f, void *source, u64 offset, u32 length, boolean send);
+status flush_writes(file f);
+status file_sync_locked(file f);
+void overlay_writes(file f, void *dest, u64 offset, u32 length);
+status release_writes(file f);
 void push_resolution(rpc r, vector path);
+void push_directory(rpc r, vector path, int count);
+status fh_fill(rpc r, buffer b);
+void fh_load(client c);
+void fh_invalidate(client c);
+void fh_save(client c);
+void fh_destroy(client c);
+void rpc_disconnect(client c);
+void cache_destroy(client c);
 status nfs4_connect(client s);
 
-// statusses should have a different allocation policy entirely
-static inline status allocate_status(client c, char *cause)
-{
-    status s = allocate(0, sizeof(struct status));
-    s->cause = cause;
-    return s;
-}
-
-static void deallocate_rpc(rpc r)
-{
-    deallocate(0, r, sizeof(struct r));
-}
+status allocate_status(client c, char *cause);
+void deallocate_rpc(rpc r);
+void spare_init(client c);
+buffer get_buffer(client c);
+void put_buffer(client c, buffer b);
 
 buffer print_path(heap h, vector v);
 
@@ -183,8 +470,9 @@ static void fill_random(char* buffer, size_t len)
 }
 
 status create_session(client c);
+status parse_sequence(client c, buffer b);
+status renew_lease(client c);
 status exchange_id(client c);
-status reclaim_complete(client c);
 void push_session_id(rpc r, u8 *session);
 status rpc_connection(client c);
 void push_owner(rpc r);
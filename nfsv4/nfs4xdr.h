@@ -557,6 +557,30 @@ enum state_protect_how4 {
     SP4_SSV = 2
 };
 
+enum channel_dir_from_client4 {
+    CDFC4_FORE              = 0x1,
+    CDFC4_BACK              = 0x2,
+    CDFC4_FORE_OR_BOTH      = 0x3,
+    CDFC4_BACK_OR_BOTH      = 0x7
+};
+
+/* sr_status_flags in the SEQUENCE reply */
+enum {
+    SEQ4_STATUS_CB_PATH_DOWN                = 0x00000001,
+    SEQ4_STATUS_CB_GSS_CONTEXTS_EXPIRING    = 0x00000002,
+    SEQ4_STATUS_CB_GSS_CONTEXTS_EXPIRED     = 0x00000004,
+    SEQ4_STATUS_EXPIRED_ALL_STATE_REVOKED   = 0x00000008,
+    SEQ4_STATUS_EXPIRED_SOME_STATE_REVOKED  = 0x00000010,
+    SEQ4_STATUS_ADMIN_STATE_REVOKED         = 0x00000020,
+    SEQ4_STATUS_RECALLABLE_STATE_REVOKED    = 0x00000040,
+    SEQ4_STATUS_LEASE_MOVED                 = 0x00000080,
+    SEQ4_STATUS_RESTART_RECLAIM_NEEDED      = 0x00000100,
+    SEQ4_STATUS_CB_PATH_DOWN_SESSION        = 0x00000200,
+    SEQ4_STATUS_BACKCHANNEL_FAULT           = 0x00000400,
+    SEQ4_STATUS_DEVID_CHANGED               = 0x00000800,
+    SEQ4_STATUS_DEVID_DELETED               = 0x00001000
+};
+
 enum why_no_delegation4 { /* New to NFSv4.1 */
         WND4_NOT_WANTED                 = 0,
         WND4_CONTENTION                 = 1,
@@ -0,0 +1,172 @@
+#include <nfs4_internal.h>
+
+// sequential readahead. once a file has been read sequentially for a
+// few calls, the data after the cursor is fetched asynchronously into
+// up to two windows, so a scan is served from memory while the next
+// window is on the wire. a window is as large as the bandwidth-delay
+// product measured from earlier reads, between NFS_READAHEAD_MIN and
+// NFS_READAHEAD_MAX bytes. windows are dropped at every lock change
+// and write, so they're never older than the lock that covers them
+
+#define SEQUENTIAL_RUN 2 // reads in a row before we start
+#define WINDOWS 2
+#define SMALL_READ (16 * 1024) // mostly round trip
+
+typedef struct window {
+    struct readahead *ra; // zero once its been dropped
+    client c;
+    u8 *data;
+    u64 offset;
+    u32 length;
+    boolean pending;
+    status s;
+    ticks start;
+} *window;
+
+struct readahead {
+    u64 next; // where a sequential read would start
+    u32 run;
+    window w[WINDOWS];
+};
+
+static void deallocate_window(window w)
+{
+    deallocate(w->c->h, w->data, w->length);
+    deallocate(w->c->h, w, sizeof(struct window));
+}
+
+// t is roughly rtt + length/bandwidth. small reads update the round
+// trip time, and larger ones the bandwidth with the round trip taken
+// out. both move an eighth of the way each time
+void measure_read(client c, u32 length, ticks t)
+{
+    if (length <= SMALL_READ) {
+        c->rtt = c->rtt ? c->rtt - c->rtt / 8 + t / 8 : t;
+        return;
+    }
+    if (t <= c->rtt) return;
+    u64 bw = ((u64)length << 32) / (t - c->rtt);
+    c->bandwidth = c->bandwidth ? c->bandwidth - c->bandwidth / 8 + bw / 8 : bw;
+}
+
+static u32 window_size(client c)
+{
+    u64 min = config_u64("NFS_READAHEAD_MIN", 64 * 1024);
+    u64 max = config_u64("NFS_READAHEAD_MAX", 4 * 1024 * 1024);
+    u64 bdp = (c->rtt * c->bandwidth) >> 32;
+    // whole multiples of the minimum, so page sized reads don't straddle two
+    return MAX(min, MIN(bdp, max) / min * min);
+}
+
+static void window_complete(void *a, status s)
+{
+    window w = a;
+    w->pending = false;
+    w->s = s;
+    if (is_ok(s)) measure_read(w->c, w->length, ktime() - w->start);
+    if (!w->ra) deallocate_window(w);
+}
+
+// a pending window belongs to its completion from here on
+static void drop_window(struct readahead *ra, int i)
+{
+    window w = ra->w[i];
+    ra->w[i] = 0;
+    if (!w) return;
+    w->ra = 0;
+    if (!w->pending) deallocate_window(w);
+}
+
+void readahead_drop(file f)
+{
+    if (!f->ra) return;
+    for (int i = 0; i < WINDOWS; i++) drop_window(f->ra, i);
+    f->ra->run = 0;
+}
+
+// the reads of windows still pending go on, and file_close waits for
+// them in drain_operations
+void readahead_close(file f)
+{
+    readahead_drop(f);
+    deallocate(f->c->h, f->ra, sizeof(struct readahead));
+    f->ra = 0;
+}
+
+// the reply may be read by another thread sharing the client, so this
+// waits its turn to receive rather than polling the socket
+static status wait_window(window w)
+{
+    client c = w->c;
+    while (w->pending) {
+        status s = client_process(c);
+        if (!is_ok(s)) return s;
+        if (w->pending && !is_ok(s = receive_reply(c))) return s;
+    }
+    return w->s;
+}
+
+// true if the read was served from a window
+boolean readahead_read(file f, void *dest, u64 offset, u32 length, status *s)
+{
+    struct readahead *ra = f->ra;
+    if (!ra) return false;
+    for (int i = 0; i < WINDOWS; i++) {
+        window w = ra->w[i];
+        if (!w || (offset < w->offset) || (offset + length > w->offset + w->length))
+            continue;
+        *s = wait_window(w);
+        if (!is_ok(*s)) {
+            readahead_drop(f);
+            return false;
+        }
+        memcpy(dest, w->data + (offset - w->offset), length);
+        return true;
+    }
+    return false;
+}
+
+// after each read, note whether its part of a run and keep the
+// windows ahead of it
+void readahead_after(file f, u64 offset, u32 length)
+{
+    client c = f->c;
+    if (!config_boolean("NFS_READAHEAD", true)) return;
+    if (!f->ra) {
+        f->ra = allocate(c->h, sizeof(struct readahead));
+        memset(f->ra, 0, sizeof(struct readahead));
+    }
+    struct readahead *ra = f->ra;
+    if (offset != ra->next) readahead_drop(f);
+    ra->next = offset + length;
+    if (++ra->run < SEQUENTIAL_RUN) return;
+
+    u64 end = ra->next;
+    for (int i = 0; i < WINDOWS; i++) {
+        window w = ra->w[i];
+        if (!w) continue;
+        // behind the cursor
+        if (w->offset + w->length <= offset) drop_window(ra, i);
+        else end = MAX(end, w->offset + w->length);
+    }
+    for (int i = 0; i < WINDOWS; i++) {
+        if (ra->w[i]) continue;
+        window w = allocate(c->h, sizeof(struct window));
+        w->ra = ra;
+        w->c = c;
+        w->offset = end;
+        w->length = window_size(c);
+        w->data = allocate(c->h, w->length);
+        w->pending = true;
+        w->start = ktime();
+        ra->w[i] = w;
+        end += w->length;
+        status s = read_async(f, w->data, w->offset, w->length, window_complete, w);
+        // just a hint, the reads will go to the server
+        if (!is_ok(s)) {
+            w->pending = false;
+            drop_window(ra, i);
+            return;
+        }
+    }
+}
@@ -4,6 +4,10 @@
 #include <unistd.h>
 #include <netinet/tcp.h>
 #include <errno.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <sys/epoll.h>
 
 static struct codepoint nfsops[] = {
 {"ACCESS"               , 3},
@@ -83,48 +87,161 @@ char *status_string(status s)
     return s->cause;
 }
 
+// causes are all static strings, so there is exactly one status for
+// each and errors never allocate past the first time they're seen
+#define STATUS_TABLE 256
+static struct status statuses[STATUS_TABLE];
+static pthread_mutex_t status_lock = PTHREAD_MUTEX_INITIALIZER;
+
+status allocate_status(client c, char *cause)
+{
+    u32 h = ((unsigned long)cause >> 3) % STATUS_TABLE;
+    status s = 0;
+    pthread_mutex_lock(&status_lock);
+    for (int i = 0; i < STATUS_TABLE; i++, h = (h + 1) % STATUS_TABLE) {
+        if (!statuses[h].cause) statuses[h].cause = cause;
+        if (statuses[h].cause == cause) {
+            s = statuses + h;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&status_lock);
+    if (!s) panic("status table full");
+    return s;
+}
+
+// small buffers for the calls and replies of rpcs, so a steady stream
+// of them doesn't go to malloc
+#define SPARE_BUFFERS 64
+#define SPARE_CAPACITY (64 * 1024)
+#define SPARE_SIZE 512
+
+// filled up front, so get_buffer only goes to malloc once more than
+// SPARE_BUFFERS are out at once
+void spare_init(client c)
+{
+    c->spare = allocate_vector(c->h, SPARE_BUFFERS);
+    for (int i = 0; i < SPARE_BUFFERS; i++)
+        vector_push(c->spare, allocate_buffer(c->h, SPARE_SIZE));
+}
+
+buffer get_buffer(client c)
+{
+    if (!vector_length(c->spare)) return allocate_buffer(c->h, SPARE_SIZE);
+    c->spare->end -= sizeof(void *);
+    buffer b;
+    memcpy(&b, c->spare->contents + c->spare->end, sizeof(void *));
+    b->start = b->end = 0;
+    return b;
+}
+
+void put_buffer(client c, buffer b)
+{
+    if ((vector_length(c->spare) < SPARE_BUFFERS) && (b->capacity <= SPARE_CAPACITY))
+        vector_push(c->spare, b);
+    else
+        deallocate_buffer(b);
+}
+
+// with no buffer the rpc gets its own call and reply buffers, which go
+// back with it. threads sharing the client each have theirs in flight
 rpc allocate_rpc(client c, buffer b) 
 {
-    // can use a single entity or a freelist
-    rpc r = allocate(s->h, sizeof(struct rpc));
-    r->b = b;
+    rpc r = allocate(c->rpcs, sizeof(struct rpc));
+    r->owned = !b;
+    r->b = b ? b : get_buffer(c);
+    r->xid = ++c->xid;
+    r->sequenceloc = 0;
+    r->result = r->owned ? get_buffer(c) : 0;
+    r->reply_header = 0;
+    r->fragment_count = 0;
+    r->n = 0;
+    r->complete = false;
+    r->completions = 0;
+    r->f = 0;
+    r->fill = 0;
+    r->bootstrap = false;
+    r->nstatus = NFS4_OK;
+    r->following = 0;
+    b = r->b;
     b->start = b->end = 0;
-    
-    // tcp framer - to be filled on transmit
-    push_be32(b, 0);
-    
-    // rpc layer 
-    push_be32(b, ++c->xid);
-    push_be32(b, 0); //call
-    push_be32(b, 2); //rpcvers
-    push_be32(b, NFS_PROGRAM);
-    push_be32(b, 4); //version
-    push_be32(b, 1); //proc
-    push_be32(b, 1); //AUTH_UNIX
-    push_be32(b, 36); //authbody - length
-    push_be32(b, 0x111ff274); // stamp - randomize this
-    push_string(b, "ip-192-168-1-40", 15);
-    push_be32(b, 0); //uid
-    push_be32(b, 0); //gid
-    push_be32(b, 0); //aux gids
-    push_be32(b, 0); //verf
-    push_be32(b, 0); //verf body kernel client passed the auth_sys structure
-
-    // v4 compound
-    push_be32(b, 0); // tag
-    push_be32(b, 1); // minor version
-    r->opcountloc = b->end;
-    b->end += 4;
+    push_bytes(b, c->header->contents, length(c->header));
+    *(u32 *)(b->contents + RPC_XID_OFFSET) = htonl(r->xid);
+    r->opcountloc = b->end - 4;
     r->c = c;
     r->opcount = 0;
     
     return r;
 }
 
-status parse_rpc(client c, buffer b, boolean *badsession)
+// everything in a call before the first op is the same for the life
+// of the client except the xid, and a SEQUENCE only differs in the slot
+// fields, so both are encoded once and copied in. the sequence is
+// rebuilt for each new session
+void rpc_templates(client c)
+{
+    if (!c->header) {
+        char name[256];
+        if (gethostname(name, sizeof(name) - 1)) strcpy(name, "localhost");
+        name[sizeof(name) - 1] = 0;
+        u32 namelen = strlen(name);
+        buffer b = c->header = allocate_buffer(c->h, 128);
+        // tcp framer - to be filled on transmit
+        push_be32(b, 0);
+
+        // rpc layer
+        push_be32(b, 0); // xid
+        push_be32(b, 0); //call
+        push_be32(b, 2); //rpcvers
+        push_be32(b, NFS_PROGRAM);
+        push_be32(b, 4); //version
+        push_be32(b, 1); //proc
+        push_be32(b, 1); //AUTH_UNIX
+        push_be32(b, 20 + pad(namelen, 4)); //authbody - length
+        push_be32(b, 0x111ff274); // stamp - randomize this
+        push_string(b, name, namelen);
+        push_be32(b, 0); //uid
+        push_be32(b, 0); //gid
+        push_be32(b, 0); //aux gids
+        push_be32(b, 0); //verf
+        push_be32(b, 0); //verf body kernel client passed the auth_sys structure
+
+        // v4 compound
+        push_be32(b, 0); // tag
+        push_be32(b, 1); // minor version
+        push_be32(b, 0); // opcount, patched in rpc_send
+    }
+    memset(c->sequence, 0, SEQUENCE_TEMPLATE);
+    *(u32 *)c->sequence = htonl(OP_SEQUENCE);
+    memcpy(c->sequence + 4, c->session, NFS4_SESSIONID_SIZE);
+}
+
+void deallocate_rpc(rpc r)
+{
+    if (r->owned) {
+        put_buffer(r->c, r->b);
+        put_buffer(r->c, r->result);
+    }
+    deallocate(r->c->rpcs, r, sizeof(struct rpc));
+}
+
+// the rpc header and the compound status, up to the results. a failed
+// compound still has the results of the ops up to the one that failed,
+// so that only fails here if there's nothing to read. the status is
+// left in r->nstatus
+status parse_rpc(rpc r, buffer b, boolean *badsession)
 {
+    client c = r->c;
     *badsession = false;
-    verify_and_adv(c, b, c->xid);
+    r->nstatus = NFS4_OK;
+    r->following = 0;
+    // aborted by a reconnect, maybe on another thread, so it goes again
+    // on the new session
+    if (!length(b)) {
+        *badsession = true;
+        return allocate_status(c, "connection reset");
+    }
+    verify_and_adv(c, b, r->xid);
     verify_and_adv(c, b, 1); // reply
     
     u32 rpcstatus = read_beu32(c, b);
@@ -134,7 +251,7 @@ status parse_rpc(client c, buffer b, boolean *badsession)
     verify_and_adv(c, b, 0); // eh?
     verify_and_adv(c, b, 0); // verf
     verify_and_adv(c, b, 0); // verf
-    u32 nstatus = read_beu32(c, b);
+    u32 nstatus = r->nstatus = read_beu32(c, b);
     if (nstatus != NFS4_OK) {
         if (config_boolean("NFS_TRACE", false))
             eprintf("nfs rpc error %s\n", codestring(nfsstatus, nstatus));
@@ -142,90 +259,407 @@ status parse_rpc(client c, buffer b, boolean *badsession)
         if (nstatus == NFS4ERR_BADSESSION) {
             *badsession = true;
         }
-        return allocate_status(c, codestring(nfsstatus, nstatus));
+        if ((nstatus == NFS4ERR_STALE) || (nstatus == NFS4ERR_FHEXPIRED))
+            fh_invalidate(c);
     }
 
     verify_and_adv(c, b, 0); // tag
+    r->following = read_beu32(c, b);
+    if ((nstatus != NFS4_OK) && !r->following)
+        return allocate_status(c, codestring(nfsstatus, nstatus));
     return STATUS_OK;
 }
 
-static int read_fully(int fd, void* buf, size_t nbyte)
+// the op and status of the next result. the server stops at the first
+// op that fails, so running out means that was the last one
+status next_result(rpc r, buffer b, u32 *op)
+{
+    client c = r->c;
+    if (!r->following) {
+        if (r->nstatus != NFS4_OK) return allocate_status(c, codestring(nfsstatus, r->nstatus));
+        return allocate_status(c, "result missing from reply");
+    }
+    r->following--;
+    *op = read_beu32(c, b);
+    u32 code = read_beu32(c, b);
+    if (code) return allocate_status(c, codestring(nfsstatus, code));
+    return STATUS_OK;
+}
+
+// the blocking socket transport, reads and writes go straight to the fd
+
+// consumes the iovec
+static int socket_readv(connection n, struct iovec *v, int count)
+{
+    ssize_t sz_read = 0, bread = 0;
+    while (1) {
+        for (; count && (bread >= v->iov_len); bread -= v->iov_len, v++, count--);
+        if (!count) return sz_read;
+        v->iov_base += bread;
+        v->iov_len -= bread;
+        bread = readv(n->fd, v, count);
+        if (bread <= 0) {
+            eprintf("socket read error %s\n", bread?strerror(errno):"closed");
+            return -1;
+        } 
+        sz_read += bread;
+    }
+}
+
+// consumes the iovec
+static int socket_writev(connection n, struct iovec *v, int count, int flags)
 {
-    ssize_t sz_read = 0;
-    char* ptr = buf;
-    while (sz_read < nbyte) {
-        ssize_t bread = read(fd, ptr, nbyte);
-        if (bread == -1) {
-            eprintf("socket read error %s\n", strerror(errno));
+    ssize_t sz_written = 0, written = 0;
+    while (1) {
+        for (; count && (written >= v->iov_len); written -= v->iov_len, v++, count--);
+        if (!count) return sz_written;
+        v->iov_base += written;
+        v->iov_len -= written;
+        struct msghdr m = {.msg_iov = v, .msg_iovlen = count};
+        written = sendmsg(n->fd, &m, flags);
+        if (written <= 0) {
+            eprintf("socket write error %s\n", strerror(errno));
             return -1;
-        } else {
-            sz_read += bread;
-            // xxx can optimize this out in success case
-            ptr += bread;
+        }
+#ifdef MSG_ZEROCOPY
+        // the kernel posts a completion for every call, not every rpc
+        if (flags & MSG_ZEROCOPY) n->zerocopy_sent++;
+#endif
+        sz_written += written;
+    }
+}
+
+struct transport socket_transport = {
+    "socket", 0, 0, socket_readv, socket_writev, 0, 0, 0
+};
+
+static int read_fully(connection n, void* buf, size_t nbyte)
+{
+    struct iovec v = {buf, nbyte};
+    return n->c->t->readv(n, &v, 1);
+}
+
+static status discard(connection n, u32 len)
+{
+    char scratch[4096];
+    while (len) {
+        u32 xfer = MIN(len, sizeof(scratch));
+        if (read_fully(n, scratch, xfer) != xfer) 
+            return allocate_status(n->c, "server socket read error");
+        len -= xfer;
+    }
+    return STATUS_OK;
+}
+
+// MSG_ZEROCOPY sends pin the caller's pages until the kernel posts a
+// completion on the error queue. a reply means the server has the data,
+// so these are normally already waiting, but the caller can't be allowed
+// to reuse its buffer until they've all been collected
+status zerocopy_wait(client c)
+{
+#ifdef MSG_ZEROCOPY
+    connection n;
+    vector_foreach(n, c->connections) {
+        while (n->zerocopy_done < n->zerocopy_sent) {
+            char control[128];
+            struct msghdr m = {.msg_control = control, .msg_controllen = sizeof(control)};
+            if (recvmsg(n->fd, &m, MSG_ERRQUEUE) < 0) {
+                if (errno == EAGAIN) {
+                    struct pollfd p = {n->fd, 0, 0};
+                    poll(&p, 1, -1); // POLLERR is always reported
+                    continue;
+                }
+                return allocate_status(c, "zerocopy completion error");
+            }
+            for (struct cmsghdr *cm = CMSG_FIRSTHDR(&m); cm; cm = CMSG_NXTHDR(&m, cm)) {
+                struct sock_extended_err *e = (struct sock_extended_err *)CMSG_DATA(cm);
+                if (e->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+                    // ee_info..ee_data is an inclusive range of send calls
+                    n->zerocopy_done += e->ee_data - e->ee_info + 1;
+            }
         }
     }
-    return sz_read;
+#endif
+    return STATUS_OK;
+}
+
+static rpc pending_rpc(client c, u32 xid)
+{
+    rpc i;
+    vector_foreach(i, c->pending) 
+        if (i->xid == xid) return i;
+    return 0;
 }
- 
- 
-static status read_response(client c, buffer b)
+
+// rpcs with completions are handed to client_process, which is woken
+// up if the reply was picked up somewhere else
+static void rpc_complete(rpc r)
 {
-    char framing[4];
-    int chars = read_fully(c->fd, framing, 4);
-    if (chars != 4) 
+    client c = r->c;
+    r->complete = true;
+    if (r->sequenceloc) c->slots[r->slot].r = 0;
+    vector_remove(c->pending, r);
+    if (r->completions) vector_push(c->completed, r);
+    if (!c->processing && (r->completions || vector_length(c->waiting)))
+        client_wakeup(c);
+    pthread_cond_broadcast(&c->received);
+}
+
+// the connection is being torn down, nothing in flight is going to get
+// an answer. the empty result will fail to parse
+void abort_pending(client c)
+{
+    while (vector_length(c->pending)) {
+        rpc r = vector_get(c->pending, 0);
+        r->result->start = r->result->end = 0;
+        rpc_complete(r);
+    }
+}
+
+// read one reply off the connection and deliver it to the rpc with the
+// matching xid, which may not be the one the caller is waiting for.
+// if the rpc expects a payload at the end of the reply, and the frame
+// is the right size to hold one, the header goes into the result buffer
+// and the payload is received directly into the caller's buffer.
+// on the blocking socket the lock is let go until the header shows up,
+// the caller has to have marked itself as the one receiving
+status read_reply(connection n)
+{
+    client c = n->c;
+    u32 header[2]; // framing, xid
+    boolean release = !c->t->buffered && !c->connecting;
+    u32 depth = release ? client_release(c) : 0;
+    int got = read_fully(n, header, sizeof(header));
+    if (release) client_reacquire(c, depth);
+    if (got != sizeof(header))
         return (allocate_status(c, "server socket read error"));
     
-    int frame = ntohl(*(u32 *)framing) & 0x07fffffff;
-    buffer_extend(b, frame);
-    chars = read_fully(c->fd, b->contents + b->start, frame);
-    if (chars != frame ) 
-        return (allocate_status(c, "server socket read error"));        
+    u32 frame = ntohl(header[0]) & 0x07fffffff;
+    if (frame < 4) return allocate_status(c, "bad framing");
+    rpc r = pending_rpc(c, ntohl(header[1]));
+    if (!r) {
+        if (config_boolean("NFS_TRACE", false))
+            eprintf("dropping reply for unknown xid %x\n", ntohl(header[1]));
+        return discard(n, frame - 4);
+    }
 
-    b->end = chars;
+    buffer b = r->result;
+    b->start = b->end = 0;
+    r->delivered = false;
+    if (r->reply_header && (frame >= r->reply_header) &&
+        (frame <= r->reply_header + pad(r->data_length, 4))) {
+        u8 padding[4];
+        bytes payload = MIN(frame - r->reply_header, r->data_length);
+        buffer_extend(b, r->reply_header);
+        struct iovec v[3] = {{b->contents + 4, r->reply_header - 4},
+                             {r->data, payload},
+                             {padding, frame - r->reply_header - payload}};
+        if (c->t->readv(n, v, 3) != frame - 4)
+            return (allocate_status(c, "server socket read error"));
+        b->end = r->reply_header;
+        r->delivered = true;
+    } else {
+        buffer_extend(b, frame);
+        if (read_fully(n, b->contents + 4, frame - 4) != frame - 4)
+            return (allocate_status(c, "server socket read error"));        
+        b->end = frame;
+    }
+    memcpy(b->contents, &header[1], 4);
     if (config_boolean("NFS_PACKET_TRACE", false)) {
         print_buffer("resp", b);
     }
+    rpc_complete(r);
+    return STATUS_OK;
+}
+
+// a connection with input waiting, or zero if none shows up within
+// timeout milliseconds. queued writes should be flushed first
+connection ready(client c, int timeout)
+{
+    connection n;
+    if (c->t->buffered) 
+        vector_foreach(n, c->connections)
+            if (c->t->buffered(n)) return n;
+    
+    int count = vector_length(c->connections);
+    struct pollfd p[count];
+    for (int i = 0; i < count; i++) {
+        p[i].fd = ((connection)vector_get(c->connections, i))->fd;
+        p[i].events = POLLIN;
+    }
+    if (poll(p, count, timeout) <= 0) return 0;
+    for (int i = 0; i < count; i++)
+        if (p[i].revents) return vector_get(c->connections, i);
+    return 0;
+}
+
+// read a reply from whichever connection has one first
+static status read_any(client c)
+{
+    if (vector_length(c->connections) == 1)
+        return read_reply(vector_get(c->connections, 0));
+
+    if (c->t->flush) {
+        status s = c->t->flush(c);
+        if (!is_ok(s)) return s;
+    }
+    boolean release = !c->t->buffered && !c->connecting;
+    u32 depth = release ? client_release(c) : 0;
+    connection n = ready(c, -1);
+    if (release) client_reacquire(c, depth);
+    if (!n) return allocate_status(c, "poll failure");
+    return read_reply(n);
+}
+
+// one thread at a time reads replies, and hands each to the rpc with
+// its xid. the others sleep until one of theirs is delivered or the
+// reader steps aside, and then look again. while a session is being
+// set up nobody else has the lock, so there's no one to wait for
+status receive_reply(client c)
+{
+    if (c->receiving) {
+        client_wait(c);
+        return STATUS_OK;
+    }
+    c->receiving = true;
+    status s = read_any(c);
+    c->receiving = false;
+    pthread_cond_broadcast(&c->received);
+    return s;
+}
+
+// the reply comes back on the connection the call went out on, but
+// whoever is receiving may be another thread
+status rpc_wait(rpc r)
+{
+    while (!r->complete) {
+        status s = receive_reply(r->c);
+        if (!is_ok(s)) return s;
+    }
     return STATUS_OK;
 }
 
+// lowest free slot under the servers current target. this is under the
+// client lock rather than a lock-free claim on the slot, since the xid,
+// the slot's sequence and the pending list all change with it on every
+// send, and the socket write right after needs the lock anyway. nothing
+// holds the lock while waiting on the network, so it doesn't keep rpcs
+// from overlapping
+static int allocate_slot(client c)
+{
+    for (int i = 0; i < c->slot_limit; i++)
+        if (!c->slots[i].r) return i;
+    return -1;
+}
+
+boolean slot_available(client c)
+{
+    return allocate_slot(c) >= 0;
+}
+
+static u32 highest_slot(client c)
+{
+    u32 h = 0;
+    for (int i = 0; i < c->maxreqs; i++)
+        if (c->slots[i].r) h = i;
+    return h;
+}
 
-static status rpc_send(rpc r)
+// the sequence op is filled in here rather than when its built so
+// that an rpc doesn't hold a slot until its actually on the wire
+status rpc_send(rpc r)
 {
+    client c = r->c;
+    if (r->sequenceloc) {
+        int slot;
+        while ((slot = allocate_slot(c)) < 0) {
+            status s = receive_reply(c);
+            if (!is_ok(s)) return s;
+        }
+        r->slot = slot;
+        c->slots[slot].r = r;
+        u32 *seq = (u32 *)(r->b->contents + r->sequenceloc);
+        seq[0] = htonl(c->slots[slot].sequence++);
+        seq[1] = htonl(slot);
+        seq[2] = htonl(highest_slot(c));
+    }
     *(u32 *)(r->b->contents + r->opcountloc) = htonl(r->opcount);
+
+    // splice the caller's fragments and their xdr padding in between
+    // the pieces of the encoded header
+    static u8 zeros[4];
+    struct iovec v[1 + 3 * RPC_FRAGMENTS];
+    int count = 0;
+    bytes total = 0, base = r->b->start;
+    for (int i = 0; i < r->fragment_count; i++) {
+        struct fragment *f = r->fragments + i;
+        v[count++] = (struct iovec){r->b->contents + base, f->offset - base};
+        v[count++] = (struct iovec){f->data, f->length};
+        v[count++] = (struct iovec){zeros, pad(f->length, 4) - f->length};
+        base = f->offset;
+        total += f->length;
+    }
+    v[count++] = (struct iovec){r->b->contents + base, r->b->end - base};
+    bytes frame = length(r->b) + total;
+    for (int i = 0; i < r->fragment_count; i++)
+        frame += pad(r->fragments[i].length, 4) - r->fragments[i].length;
+    
     // framer length
-    *(u32 *)(r->b->contents) = htonl(0x80000000 + length(r->b)-4);
+    *(u32 *)(r->b->contents) = htonl(0x80000000 + frame - 4);
     if (config_boolean("NFS_PACKET_TRACE", false))
         print_buffer("sent", r->b);
-    
-    int res = write(r->c->fd, r->b->contents + r->b->start, length(r->b));
-    if (res != length(r->b)) {
-        return allocate_status(r->c, "failed rpc write");
+
+    // spread requests over the connections bound to the session, unless
+    // the caller has picked one
+    if (!r->n) 
+        r->n = vector_get(c->connections, c->next_connection++ % c->bound);
+
+    int flags = 0;
+#ifdef MSG_ZEROCOPY
+    if (c->zerocopy && (total >= c->zerocopy)) flags = MSG_ZEROCOPY;
+#endif
+    if (c->t->writev(r->n, v, count, flags) != frame) {
+        // the server never saw this sequence id, so the slot goes back
+        // the way it was for the next request on it
+        if (r->sequenceloc) {
+            c->slots[r->slot].sequence--;
+            c->slots[r->slot].r = 0;
+            pthread_cond_broadcast(&c->received);
+        }
+        return allocate_status(c, "failed rpc write");
     }
+    r->complete = false;
+    vector_push(c->pending, r);
     return STATUS_OK;
 }
 
     
-status nfs4_connect(client c)
+static status connect_one(client c, connection n)
 {
-    int temp;
     struct sockaddr_in a;
-
-    struct hostent *he = gethostbyname(c->hostname->contents);
-    memcpy(&c->address, he->h_addr, 4);
     
-    c->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);    
+    n->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);    
     // xxx - abstract
     memcpy(&a.sin_addr, &c->address, 4);
     a.sin_family = AF_INET;
-    a.sin_port = htons(2049); //configure
+    a.sin_port = htons(config_u64("NFS_PORT", 2049));
+
+#ifdef MSG_ZEROCOPY
+    if (c->zerocopy) {
+        int one = 1;
+        if (setsockopt(n->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+            c->zerocopy = 0;
+    }
+    n->zerocopy_sent = n->zerocopy_done = 0;
+#endif
 
     if (config_boolean("NFS_TCP_NODELAY", true)) {
-        unsigned char x = 1;
-        setsockopt(c->fd, /*SOL_TCP*/0, TCP_NODELAY,
+        int x = 1;
+        setsockopt(n->fd, IPPROTO_TCP, TCP_NODELAY,
                    (char *)&x, sizeof(x));
     }
     
-    int res = connect(c->fd,
+    int res = connect(n->fd,
                       (struct sockaddr *)&a,
                       sizeof(struct sockaddr_in));
     if (res != 0) {
@@ -235,61 +669,154 @@ status nfs4_connect(client c)
     return STATUS_OK;
 }
 
-void push_resolution_rfh(rpc r, vector path)
+// opens all NFS_CONNECTIONS sockets, only the first is usable until
+// the rest are bound to the session by bind_connections
+status nfs4_connect(client c)
 {
-    push_op(r, OP_PUTFH);
-    push_string(r->b, r->c->root_filehandle, NFS4_FHSIZE);
-    buffer i;
-    vector_foreach(i, path) {
-        push_op(r, OP_LOOKUP);
-        push_string(r->b, i->contents + i->start, length(i));
+    // gethostbyname isn't safe with other clients connecting on other threads
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM}, *ai;
+    if (getaddrinfo(c->hostname->contents, 0, &hints, &ai))
+        return allocate_status(c, "host lookup failure");
+    memcpy(&c->address, &((struct sockaddr_in *)ai->ai_addr)->sin_addr, 4);
+    freeaddrinfo(ai);
+
+    abort_pending(c);
+    connection n;
+    vector_foreach(n, c->connections) {
+        if (n->fd >= 0) {
+            if (c->t->detach) c->t->detach(n);
+            close(n->fd);
+        }
+        n->fd = -1;
     }
+    c->bound = 1;
+    c->next_connection = 0;
+#ifdef MSG_ZEROCOPY
+    c->zerocopy = config_u64("NFS_ZEROCOPY_MIN", 0);
+#endif
+    
+    vector_foreach(n, c->connections) {
+        status s = connect_one(c, n);
+        // the extra ones are only a bonus, see bind_connections
+        if (!is_ok(s) && (n != vector_get(c->connections, 0))) {
+            close(n->fd);
+            n->fd = -1;
+            continue;
+        }
+        if (!is_ok(s)) return s;
+        if (c->epoll >= 0) {
+            struct epoll_event e = {.events = EPOLLIN, .data.ptr = n};
+            epoll_ctl(c->epoll, EPOLL_CTL_ADD, n->fd, &e);
+        }
+        if (c->t->attach && !is_ok(s = c->t->attach(n))) {
+            // keep going on the blocking transport
+            if (config_boolean("NFS_TRACE", false))
+                eprintf("%s transport unavailable: %s\n", c->t->name, status_string(s));
+            c->t = &socket_transport;
+        }
+    }
+    return STATUS_OK;
 }
 
+// the containing directory comes from the filehandle cache
 void push_resolution(rpc r, vector path)
 {
-    push_op(r, OP_PUTROOTFH);
-    buffer i;
-    vector_foreach(i, path) {
-        push_op(r, OP_LOOKUP);
-        push_string(r->b, i->contents + i->start, length(i));
+    int count = vector_length(path);
+    if (!count) {
+        push_op(r, OP_PUTROOTFH);
+        return;
     }
+    push_directory(r, path, count - 1);
+    buffer i = vector_get(path, count - 1);
+    push_op(r, OP_LOOKUP);
+    push_string(r->b, i->contents + i->start, length(i));
 }
 
-static status read_until(client c, buffer b, u32 which)
+// any successful SEQUENCE renews the lease - 8.3
+status parse_sequence(client c, buffer b)
 {
-    int opcount = read_beu32(c, b);
-    while (1) {
-        int op =  read_beu32(c, b);
-        if (op == which) {
-            return STATUS_OK;
-        }
-        u32 code = read_beu32(c, b);
-        if (code != 0) return allocate_status(c, codestring(nfsstatus, code));
-        switch (op) {
-        case OP_SEQUENCE:
-            b->start += NFS4_SESSIONID_SIZE; // 16
-            u32 seq = read_beu32(c, b);  // 20
-            b->start += 16; // 36
-            break;
-        case OP_PUTROOTFH:
-            break;
-        case OP_PUTFH:
-            break;
-        case OP_LOOKUP:
-            break;
-        default:
-            // printf style with code
-            return allocate_status(c, "unhandled scan code");
+    b->start += NFS4_SESSIONID_SIZE; 
+    read_beu32(c, b); // sequenceid
+    read_beu32(c, b); // slotid
+    read_beu32(c, b); // highest slotid
+    u32 target = read_beu32(c, b); // target highest slotid
+    u32 flags = read_beu32(c, b); // status flags
+    c->slot_limit = MIN(target + 1, c->maxreqs);
+    c->renewed = ktime();
+    if ((flags & (SEQ4_STATUS_EXPIRED_ALL_STATE_REVOKED |
+                  SEQ4_STATUS_EXPIRED_SOME_STATE_REVOKED |
+                  SEQ4_STATUS_ADMIN_STATE_REVOKED)) &&
+        config_boolean("NFS_TRACE", false))
+        eprintf("server revoked state, sequence flags %x\n", flags);
+    // without a callback path a delegation can't be recalled, so it
+    // can't be relied on either
+    if (flags & (SEQ4_STATUS_CB_PATH_DOWN | SEQ4_STATUS_CB_PATH_DOWN_SESSION |
+                 SEQ4_STATUS_RECALLABLE_STATE_REVOKED |
+                 SEQ4_STATUS_EXPIRED_ALL_STATE_REVOKED |
+                 SEQ4_STATUS_EXPIRED_SOME_STATE_REVOKED |
+                 SEQ4_STATUS_ADMIN_STATE_REVOKED))
+        c->delegation_epoch++;
+    return STATUS_OK;
+}
+
+// the filehandle isn't used, the root is reached by PUTROOTFH
+static status parse_root(client c, buffer res)
+{
+    u32 len = read_beu32(c, res);
+    if (len > NFS4_FHSIZE) return allocate_status(c, "encoding mismatch");
+    c->root_filehandle_len = len;
+    status st = read_buffer(c, res, &c->root_filehandle, len);
+    res->start += pad(len, 4) - len;
+    return st;
+}
+
+static status parse_lease(client c, buffer res)
+{
+    struct fattr a;
+    status st = parse_fattr(c, res, &a);
+    if (!is_ok(st)) return st;
+    if (a.mask & (1ull<<FATTR4_LEASE_TIME)) c->lease = a.lease_time;
+    return STATUS_OK;
+}
+
+// the body of a successful result for an op before the one we're
+// interested in. the ones with side effects are handled here, the
+// rest are stepped over by their layout
+static status parse_result(rpc r, buffer b, u32 op)
+{
+    client c = r->c;
+    switch (op) {
+    case OP_SEQUENCE:
+        return parse_sequence(c, b);
+    case OP_PUTROOTFH:
+    case OP_PUTFH:
+    case OP_LOOKUP:
+    case OP_SAVEFH:
+    case OP_RESTOREFH:
+        break;
+    case OP_GETFH:
+        if (r->bootstrap) return parse_root(c, b);
+        if (r->fill) return fh_fill(r, b);
+        return skip_result(c, b, op);
+    case OP_GETATTR:
+        if (r->bootstrap) return parse_lease(c, b);
+        return skip_result(c, b, op);
+    case OP_RECLAIM_COMPLETE:
+        if (r->bootstrap) {
+            r->bootstrap = false;
+            set_bootstrap(c, BOOTSTRAP_DONE);
         }
+        break;
+    default:
+        return skip_result(c, b, op);
     }
-    // fix
     return STATUS_OK;
 }
 
-static rpc file_rpc(file f)
+static rpc file_rpc(file f, buffer b)
 {
-    rpc r = allocate_rpc(f->c, f->c->forward);
+    rpc r = allocate_rpc(f->c, b);
+    r->f = f;
     push_sequence(r);
 
     push_op(r, OP_PUTFH);
@@ -302,28 +829,42 @@ static rpc file_rpc(file f)
 }
 
 
+// leaves result positioned after the status of op, the ones before it
+// are handed to parse_result. a GETFH for the filehandle cache isn't
+// the one the caller wants. if op went through and one after it
+// didn't, that's the status, and r->following says there's more to read
+status parse_reply(rpc r, int op, buffer result, boolean *badsession)
+{
+    status s = parse_rpc(r, result, badsession);
+    if (!is_ok(s)) return s;
+    while (1) {
+        u32 which;
+        s = next_result(r, result, &which);
+        if (!is_ok(s)) return s;
+        if ((which == op) && !((op == OP_GETFH) && r->fill)) break;
+        s = parse_result(r, result, which);
+        if (!is_ok(s)) return s;
+    }
+    if (r->nstatus == NFS4_OK) return STATUS_OK;
+    return allocate_status(r->c, codestring(nfsstatus, r->nstatus));
+}
+
 status base_transact(rpc r, int op, buffer result, boolean *badsession)
 {
+    r->result = result;
     status s = rpc_send(r);
     if (!is_ok(s)) return s;
-    result->start = result->end = 0;
-    s = read_response(r->c, result);
+    s = rpc_wait(r);
     if (!is_ok(s)) return s;
     // should instead keep session alive
-    s = parse_rpc(r->c, result, badsession);
-    if (!is_ok(s)) return s;
-    s = read_until(r->c, result, op);
-    if (!is_ok(s)) return s;
-    u32 code = read_beu32(r->c, result);
-    if (code == 0) return STATUS_OK;
-    return allocate_status(r->c, codestring(nfsstatus, code));    
+    return parse_reply(r, op, result, badsession);
 }
 
 status exchange_id(client c)
 {
-    rpc r = allocate_rpc(c, c->reverse);
+    rpc r = allocate_rpc(c, 0);
     push_exchange_id(r);
-    buffer res = c->reverse;
+    buffer res = r->result;
     boolean bs;
     status st = base_transact(r, OP_EXCHANGE_ID, res, &bs);
     if (!is_ok(st)) {
@@ -342,12 +883,16 @@ status exchange_id(client c)
                   
 status create_session(client c)
 {
-    rpc r = allocate_rpc(c, c->reverse);
-    r->c->sequence = 1;  // 18.36.4 says that a new session starts at 1 implicitly
+    rpc r = allocate_rpc(c, 0);
+    // 18.36.4 says that a new session starts at 1 implicitly
+    for (int i = 0; i < c->maxreqs; i++) {
+        c->slots[i].sequence = 1;
+        c->slots[i].r = 0;
+    }
     r->c->lock_sequence = 1;
     push_create_session(r);
     r->c->server_sequence++;    
-    buffer res = c->reverse;
+    buffer res = r->result;
     status st = transact(r, OP_CREATE_SESSION, res);
     if (!is_ok(st)) {
         deallocate_rpc(r);    
@@ -358,57 +903,115 @@ status create_session(client c)
         deallocate_rpc(r);
         return st;
     }
+    c->slot_limit = c->maxreqs;
+    rpc_templates(c);
     deallocate_rpc(r);
     return STATUS_OK;
 }
 
-status get_root_fh(client c)
+// the end of session setup: the root filehandle with the lease time,
+// and RECLAIM_COMPLETE, which has to come before any OPEN. their
+// results are picked up by parse_result
+#define BOOTSTRAP_OPS 4
+
+static void push_bootstrap_ops(rpc r)
 {
-    rpc r = allocate_rpc(c, c->reverse);
-    push_sequence(r);
     push_op(r, OP_PUTROOTFH);
     push_op(r, OP_GETFH);
-    buffer res = c->reverse;
-    boolean bs2;
-    status st = base_transact(r, OP_GETFH, res, &bs2);
-    if (!is_ok(st)) {
-        deallocate_rpc(r);
-        return st;
-    }
-    u32 root_filehandle_len = read_beu32(c, res);
-    if (root_filehandle_len > NFS4_FHSIZE) {
-        return allocate_status(c, "encoding mismatch");
-    }
-    c->root_filehandle_len = root_filehandle_len;
+    push_attr_request(r, 1ull<<FATTR4_LEASE_TIME);
+    push_op(r, OP_RECLAIM_COMPLETE);
+    push_be32(r->b, 0); // rca_one_fs
+    r->bootstrap = true;
+    r->c->bootstrap = BOOTSTRAP_SENT;
+}
 
-    st = read_buffer(c, res, &c->root_filehandle, c->root_filehandle_len);
+// on its own, for a session rebuilt under open files, or ahead of an
+// open with too many ops of its own
+static status bootstrap(client c)
+{
+    rpc r = allocate_rpc(c, 0);
+    push_sequence(r);
+    push_bootstrap_ops(r);
+    boolean bs;
+    status st = base_transact(r, OP_RECLAIM_COMPLETE, r->result, &bs);
+    // RECLAIM_COMPLETE goes with the client id, not the session, so a
+    // carrier we gave up on may have gotten it in. the root and lease
+    // ahead of it were parsed all the same
+    if (r->nstatus == NFS4ERR_COMPLETE_ALREADY) st = STATUS_OK;
     deallocate_rpc(r);
-    if (!is_ok(st)) return st;
+    set_bootstrap(c, is_ok(st) ? BOOTSTRAP_DONE : BOOTSTRAP_OWED);
+    return st;
+}
+
+// the rpc carrying it is still waiting on its reply
+static boolean bootstrap_pending(client c)
+{
+    rpc i;
+    vector_foreach(i, c->pending)
+        if (i->bootstrap) return true;
+    return false;
+}
+
+// after the SEQUENCE of the first open on a session, so that open
+// carries the end of setup rather than waiting two round trips on it.
+// following is how many ops the open adds after this
+status push_bootstrap(rpc r, int following)
+{
+    client c = r->c;
+    u32 generation = c->generation;
+    // another thread's open is carrying it. once its reply is off the
+    // wire there may be nothing left to read, so wait for the carrier
+    // to parse it instead. if the read fails or the session is replaced
+    // that carrier may never get there, and this one does it alone
+    while ((c->bootstrap == BOOTSTRAP_SENT) && (c->generation == generation)) {
+        if (!bootstrap_pending(c)) client_wait(c);
+        else if (!is_ok(receive_reply(c))) break;
+    }
+    if (c->bootstrap == BOOTSTRAP_SENT) return bootstrap(c);
+    if (c->bootstrap != BOOTSTRAP_OWED) return STATUS_OK;
+    if (r->opcount + BOOTSTRAP_OPS + following > c->maxops) return bootstrap(c);
+    push_bootstrap_ops(r);
     return STATUS_OK;
 }
 
+// a SEQUENCE on its own, and if that doesn't go through, a new session
+status renew_lease(client c)
+{
+    rpc r = allocate_rpc(c, 0);
+    push_sequence(r);
+    boolean badsession;
+    status s = base_transact(r, OP_SEQUENCE, r->result, &badsession);
+    if (is_ok(s)) s = parse_sequence(c, r->result);
+    deallocate_rpc(r);
+    if (is_ok(s)) return s;
+    if (config_boolean("NFS_TRACE", false))
+        eprintf("lease renewal failed: %s, reconnecting\n", status_string(s));
+    return rpc_connection(c);
+}
+
 static status replay_rpc(rpc r)
 {
-    // ok sad, framer + xid + call + rpc + program + version + proc + auth + authbody + verf + verf2
-    // tag + minor + opcount + sequence op
     // verify that we're starting with a sequence, which should always be the case
-    // except for exchangeid and create session
-    u32 offset = 4 * 15;
-    memcpy(r->b->contents + offset, r->c->session, NFS4_SESSIONID_SIZE);
-    u32 nseq = htonl(r->c->sequence);
-    r->c->sequence++;
-    memcpy(r->b->contents + offset + NFS4_SESSIONID_SIZE, &nseq, 4);
-    u32 nxid = htonl(++r->c->xid);
-    memcpy(r->b->contents + 4, &nxid, 4);    
+    // except for exchangeid and create session. the slot and sequence
+    // are reassigned by rpc_send
+    if (r->sequenceloc)
+        memcpy(r->b->contents + r->sequenceloc - NFS4_SESSIONID_SIZE,
+               r->c->session, NFS4_SESSIONID_SIZE);
+    r->xid = ++r->c->xid;
+    r->n = 0;
+    if (r->bootstrap) r->c->bootstrap = BOOTSTRAP_SENT;
+    *(u32 *)(r->b->contents + RPC_XID_OFFSET) = htonl(r->xid);
 }
 
 static status destroy_session(client c)
 {
-    rpc r = allocate_rpc(c, c->reverse);
+    rpc r = allocate_rpc(c, 0);
     push_op(r, OP_DESTROY_SESSION);
     push_session_id(r, c->session);
     boolean bs2;
-    return base_transact(r, OP_DESTROY_SESSION, c->reverse, &bs2);
+    status s = base_transact(r, OP_DESTROY_SESSION, r->result, &bs2);
+    deallocate_rpc(r);
+    return s;
 }
 
 status transact(rpc r, int op, buffer result)
@@ -417,152 +1020,945 @@ status transact(rpc r, int op, buffer result)
     boolean badsession = true;
     status s;
     
+    client_lock(r->c);
     while ((tries < 2 ) && (badsession == true)) {
+        u32 generation = r->c->generation;
         s = base_transact(r, op, result, &badsession);
-        if (badsession) {
+        // another thread may have set up the new session while we waited
+        if (badsession && (r->c->generation == generation)) {
             status s2 = rpc_connection(r->c);
-            if (!is_ok(s2)) return s2;
+            if (!is_ok(s2)) {
+                s = s2;
+                break;
+            }
+        }
+        if (badsession) {
             replay_rpc(r);
             tries++;
         }
     }
+    client_unlock(r->c);
+    return s;
+}
+
+
+static status file_attribute(file f, int attr, struct fattr *a)
+{
+    client_lock(f->c);
+    // anything held here has to be reflected
+    status s = flush_writes(f);
+    if (is_ok(s)) {
+        rpc r = file_rpc(f, 0);
+        push_attr_request(r, 1ull<<attr);
+        s = transact(r, OP_GETATTR, r->result);
+        if (is_ok(s)) s = parse_fattr(f->c, r->result, a);
+        deallocate_rpc(r);
+        if (is_ok(s) && !(a->mask & (1ull<<attr)))
+            s = allocate_status(f->c, "attribute missing from reply");
+    }
+    client_unlock(f->c);
     return s;
 }
 
 status file_size(file f, u64 *dest)
 {
-    rpc r = file_rpc(f);
-    push_op(r, OP_GETATTR);
-    push_be32(r->b, 1); 
-    u32 mask = 1<<FATTR4_SIZE;
-    push_be32(r->b, mask);
-    buffer res =f->c->reverse;
-    status s = transact(r, OP_GETATTR, res);
-    if (!is_ok(s)) return s;
-    // demux attr more better
-    res->start = res->end - 8;
-    u64 x = 0;
-    *dest = read_beu64(f->c, res);  
-    return STATUS_OK;
+    struct fattr a;
+    status s = file_attribute(f, FATTR4_SIZE, &a);
+    if (is_ok(s)) *dest = a.size;
+    return s;
+}
+
+status file_change(file f, u64 *dest)
+{
+    struct fattr a;
+    client_lock(f->c);
+    status s = file_attribute(f, FATTR4_CHANGE, &a);
+    if (is_ok(s)) {
+        // whatever was read ahead may predate it
+        readahead_drop(f);
+        cache_revalidate(f, a.change);
+        *dest = a.change;
+    }
+    client_unlock(f->c);
+    return s;
 }
 
-// we can actually use the framing length to delineate 
-// header and data, and read directly into the dest buffer
-// because the data is always at the end
-status read_chunk(file f, void *dest, u64 offset, u32 length)
+static void push_read(rpc r, file f, u64 offset, u32 length)
 {
-    rpc r = file_rpc(f);
     push_op(r, OP_READ);
     push_stateid(r, &f->latest_sid);
     push_be64(r->b, offset);
     push_be32(r->b, length);
-    buffer res = f->c->reverse;
-    status s = transact(r, OP_READ, res);
+}
+
+// the source is not copied into b, rpc_send gathers it from the
+// caller's buffer
+// add synch
+static void push_write(rpc r, file f, void *source, u64 offset, u32 length, u32 stable)
+{
+    push_op(r, OP_WRITE);
+    push_stateid(r, &f->latest_sid);
+    push_be64(r->b, offset);
+    push_be32(r->b, stable);
+    push_fragment(r, source, length);
+}
+
+// section 8.2.3, rfc 5661. the stateid left by the previous op in the
+// compound
+static struct stateid current_stateid = {.sequence = 1};
+
+// section 8.2.2, rfc 5661. a zero sequence is whatever the latest is,
+// so locks in flight together don't trip over each others updates
+static stateid latest_lock_stateid(file f, struct stateid *s)
+{
+    *s = f->lock_sid;
+    s->sequence = 0;
+    return s;
+}
+
+// a lock stateid from before a reconnect may not mean anything to the
+// server now, so the lock owner is introduced again
+static boolean lock_owner_known(file f)
+{
+    return f->lock_owner && (f->lock_generation == f->c->generation);
+}
+
+// once the lock owner exists on the file it's named by its lock stateid,
+// or by the one the previous op left if it's chained on in the same compound
+static void push_lock(rpc r, file f, u32 locktype, u64 offset, u64 length, boolean chained)
+{
+    struct stateid s;
+    push_op(r, OP_LOCK);
+    push_be32(r->b, locktype);
+    push_boolean(r->b, false); // reclaim
+    push_be64(r->b, offset);
+    push_be64(r->b, length);
+
+    if (chained || lock_owner_known(f)) {
+        push_boolean(r->b, false); // existing lock owner
+        push_stateid(r, chained ? &current_stateid : latest_lock_stateid(f, &s));
+        push_lock_sequence(r);
+        return;
+    }
+    push_boolean(r->b, true); // new lock owner
+    push_bare_sequence(r);
+    push_stateid(r, &f->open_sid);
+    push_lock_sequence(r);
+    push_owner(r);
+}
+
+static void push_unlock(rpc r, file f, u32 locktype, u64 offset, u64 length, boolean chained)
+{
+    struct stateid s;
+    push_op(r, OP_LOCKU);
+    push_be32(r->b, locktype);
+    push_bare_sequence(r);
+    if (chained) push_stateid(r, &current_stateid);
+    else if (lock_owner_known(f)) push_stateid(r, latest_lock_stateid(f, &s));
+    else push_stateid(r, &f->latest_sid);
+    push_be64(r->b, offset);
+    push_be64(r->b, length);
+}
+
+// LOCK and LOCKU both leave the new lock stateid
+status lock_stateid(file f, buffer b)
+{
+    status s = parse_stateid(f->c, b, &f->latest_sid);
     if (!is_ok(s)) return s;
+    f->lock_sid = f->latest_sid;
+    f->lock_owner = true;
+    f->lock_generation = f->c->generation;
+    return s;
+}
+
+// the data is always at the end, so the framing length delineates
+// header and data and read_reply can receive it directly into dest
+rpc read_chunk(file f, buffer b, void *dest, u64 offset, u32 length)
+{
+    rpc r = file_rpc(f, b);
+    push_read(r, f, offset, length);
+    r->data = dest;
+    r->data_length = length;
+    // everything ahead of SEQUENCE and READ has an empty result
+    r->reply_header = RPC_REPLY_HEADER + SEQUENCE_REPLY + 
+        (r->opcount - 2) * EMPTY_OP_REPLY + READ_REPLY_HEADER;
+    return r;
+}
+
+status read_chunk_complete(rpc r)
+{
+    buffer res = r->result;
     // we dont care if its the end of file -- we might for a single round trip read entire
     res->start += 4; 
     u32 len = read_beu32(r->c, res);
-    // guard against len != length
-    memcpy(dest, res->contents+res->start, len);
+    if (len > r->data_length) return allocate_status(r->c, "read overrun");
+    if (!r->delivered) 
+        memcpy(r->data, res->contents+res->start, len);
+    // past the end of the file reads as zeros
+    memset(r->data + len, 0, r->data_length - len);
     return STATUS_OK;
 }
 
-// if we break transact, can writev with the header and 
-// source buffer as two fragments
-// add synch
-status write_chunk(file f, void *source, u64 offset, u32 length)
+rpc write_chunk(file f, buffer b, void *source, u64 offset, u32 length)
 {
-    rpc r = file_rpc(f);
-    push_op(r, OP_WRITE);
-    push_stateid(r, &f->latest_sid);
-    push_be64(r->b, offset);
-    push_be32(r->b, FILE_SYNC4);
-    push_string(r->b, source, length);
-    buffer b = f->c->reverse;
-    return transact(r, OP_WRITE, b);
+    rpc r = file_rpc(f, b);
+    push_write(r, f, source, offset, length, FILE_SYNC4);
+    r->data = source;
+    r->data_length = length;
+    return r;
+}
+
+status write_chunk_complete(rpc r)
+{
+    u32 count = read_beu32(r->c, r->result);
+    if (count != r->data_length) return allocate_status(r->c, "short write");
+    return STATUS_OK;
 }
 
 buffer push_initial_path(rpc r, vector path)
 {
-    struct buffer initial;
-    memcpy(&initial, path, sizeof(struct buffer));
-    initial.end  -= sizeof(void *);
-    push_resolution_rfh(r, &initial);
+    push_directory(r, path, vector_length(path) - 1);
     return vector_get(path, vector_length(path)-1);
 }
 
-status segment(status (*each)(file, void *, u64, u32), int chunksize, file f, void *x, u64 offset, u32 length)
+// wait for whichever of the rpcs in set completes first
+static status wait_any(client c, vector set, rpc *r)
 {
-    for (u32 done = 0; done < length;) {
-        u32 xfer = MIN(length - done, chunksize);
-        status s = each(f, x + done, offset+done, xfer);
+    while (1) {
+        rpc i;
+        vector_foreach(i, set) {
+            if (i->complete) {
+                *r = i;
+                return STATUS_OK;
+            }
+        }
+        status s = receive_reply(c);
         if (!is_ok(s)) return s;
-        done += xfer;
     }
-    return STATUS_OK;
 }
 
-status reclaim_complete(client c)
+// keeps up to io_depth chunks in flight and retires them in the order
+// the replies arrive. chunks that come back with a bad session, or that
+// were outstanding when the connection failed, are held until everything
+// else has drained. the first is then replayed through transact, which
+// reconnects, and the rest are resent on the new session
+status segment(rpc (*start)(file, buffer, void *, u64, u32),
+               status (*complete)(rpc),
+               int op, int chunksize, file f, void *x, u64 offset, u32 length)
 {
-    rpc r = allocate_rpc(c, c->reverse);
-    push_sequence(r);
-    push_op(r, OP_RECLAIM_COMPLETE);
-    push_be32(r->b, 0);
+    client c = f->c;
+    client_lock(c);
+    vector inflight = get_buffer(c);
+    vector retry = get_buffer(c);
+    status s = STATUS_OK;
+    int recoveries = 0;
+    u32 done = 0;
+    rpc r;
+
+    while (is_ok(s) && ((done < length) || vector_length(inflight) || vector_length(retry))) {
+        if (vector_length(retry) && !vector_length(inflight)) {
+            if (recoveries++ > 1) {
+                s = allocate_status(c, "session recovery failed");
+                break;
+            }
+            r = vector_pop(retry);
+            replay_rpc(r);
+            s = transact(r, op, r->result);
+            if (is_ok(s)) s = complete(r);
+            deallocate_rpc(r);
+            while (is_ok(s) && vector_length(retry)) {
+                r = vector_pop(retry);
+                replay_rpc(r);
+                s = rpc_send(r);
+                if (is_ok(s)) vector_push(inflight, r);
+                else deallocate_rpc(r);
+            }
+            continue;
+        }
+        
+        while (!vector_length(retry) && (done < length) && (vector_length(inflight) < c->io_depth)) {
+            u32 xfer = MIN(length - done, chunksize);
+            r = start(f, 0, x + done, offset + done, xfer);
+            vector_push(is_ok(rpc_send(r)) ? inflight : retry, r);
+            done += xfer;
+        }
+        if (!vector_length(inflight)) continue;
+        
+        if (!is_ok(wait_any(c, inflight, &r))) {
+            // the connection is gone, everything outstanding has to be resent
+            abort_pending(c);
+            while (vector_length(inflight)) 
+                vector_push(retry, vector_pop(inflight));
+            continue;
+        }
+        vector_remove(inflight, r);
+        boolean badsession;
+        s = parse_reply(r, op, r->result, &badsession);
+        if (badsession) {
+            vector_push(retry, r);
+            s = STATUS_OK;
+            continue;
+        }
+        if (is_ok(s)) s = complete(r);
+        deallocate_rpc(r);
+    }
+
+    // on error there may be chunks still in flight which refer to the buffers
+    while (vector_length(inflight)) {
+        r = vector_pop(inflight);
+        if (!is_ok(rpc_wait(r))) abort_pending(c);
+        deallocate_rpc(r);
+    }
+    while (vector_length(retry))
+        deallocate_rpc(vector_pop(retry));
+    status zs = zerocopy_wait(c);
+    if (is_ok(s)) s = zs;
+    put_buffer(c, inflight);
+    put_buffer(c, retry);
+    client_unlock(c);
+    return s;
+}
+
+
+// section 18.34, rfc 5661 - associate an additional connection with
+// the session so sequenced requests can be sent on it
+static status bind_connection(client c, connection n)
+{
+    rpc r = allocate_rpc(c, 0);
+    r->n = n;
+    push_op(r, OP_BIND_CONN_TO_SESSION);
+    push_session_id(r, c->session);
+    push_be32(r->b, CDFC4_FORE);
+    push_boolean(r->b, false); // rdma mode
     boolean bs;
-    status st = base_transact(r, OP_RECLAIM_COMPLETE, c->reverse, &bs);
-    deallocate_rpc(r);        
+    status st = base_transact(r, OP_BIND_CONN_TO_SESSION, r->result, &bs);
+    deallocate_rpc(r);
     return st;
 }
 
+static void drop_connection(client c, connection n)
+{
+    if (n->fd < 0) return;
+    if (c->t->detach) c->t->detach(n);
+    if (c->epoll >= 0) epoll_ctl(c->epoll, EPOLL_CTL_DEL, n->fd, 0);
+    close(n->fd);
+    n->fd = -1;
+}
 
-status rpc_connection(client c)
+// for client_destroy. anything still waiting on a reply fails
+void rpc_disconnect(client c)
+{
+    static u8 none[NFS4_SESSIONID_SIZE];
+    connection n = vector_get(c->connections, 0);
+    // a client that never got as far as a session has nothing to destroy
+    if (memcmp(c->session, none, NFS4_SESSIONID_SIZE) && (n->fd >= 0)) destroy_session(c);
+    abort_pending(c);
+    vector_foreach(n, c->connections) drop_connection(c, n);
+    if (c->t->release) c->t->release(c);
+}
+
+// a connection that won't bind is closed and the session carries on
+// over the rest. the bound ones are moved to the front, since that's
+// where rpc_send looks for them. the next reconnect tries them all again
+static status bind_connections(client c)
+{
+    int count = vector_length(c->connections);
+    connection bound[count], failed[count];
+    int nbound = 1, nfailed = 0;
+    bound[0] = vector_get(c->connections, 0);
+    for (int i = 1; i < count; i++) {
+        connection n = vector_get(c->connections, i);
+        status s = n->fd < 0 ? allocate_status(c, "not connected") : bind_connection(c, n);
+        if (is_ok(s)) {
+            bound[nbound++] = n;
+            continue;
+        }
+        if (config_boolean("NFS_TRACE", false))
+            eprintf("connection %d not bound: %s\n", i, status_string(s));
+        drop_connection(c, n);
+        failed[nfailed++] = n;
+    }
+    c->connections->end = c->connections->start;
+    for (int i = 0; i < nbound; i++) vector_push(c->connections, bound[i]);
+    for (int i = 0; i < nfailed; i++) vector_push(c->connections, failed[i]);
+    c->bound = nbound;
+    return STATUS_OK;
+}
+
+static status connect_session(client c)
 {
+    // delegations aren't reclaimed on the new session
+    c->delegation_epoch++;
     status s = nfs4_connect(c);
     if (!is_ok(s)) return s;
     s = exchange_id(c);
     if (!is_ok(s)) return s;
     s = create_session(c);
     if (!is_ok(s)) return s;
-    s = get_root_fh(c);
+    s = bind_connections(c);
     if (!is_ok(s)) return s;
-    s = reclaim_complete(c);
+    // until the first open has gone out, that can carry it
+    if (c->bootstrap != BOOTSTRAP_DONE) {
+        set_bootstrap(c, BOOTSTRAP_OWED);
+        return STATUS_OK;
+    }
+    return bootstrap(c);
+}
+
+// the lock is kept for the whole setup, so other threads don't send on
+// a half built session, or read the replies meant for it. whoever is
+// reading off the old socket is let finish first, and if another thread
+// rebuilt the session meanwhile that one will do. create_session can
+// come back here through transact, that just starts over
+status rpc_connection(client c)
+{
+    client_lock(c);
+    if (!c->connecting) {
+        u32 generation = c->generation;
+        while (c->receiving) client_wait(c);
+        if (c->generation != generation) {
+            client_unlock(c);
+            return STATUS_OK;
+        }
+    }
+    boolean outer = !c->connecting;
+    c->connecting = true;
+    status s = connect_session(c);
+    if (outer) {
+        c->connecting = false;
+        c->generation++;
+    }
+    client_unlock(c);
     return s;
 }
 
-status lock_range(file f, u32 locktype, u64 offset, u64 length)
+// taking a lock is when the cached pages are checked
+rpc lock_rpc(file f, buffer b, u32 locktype, u64 offset, u64 length)
 {
-    rpc r = file_rpc(f);
-    push_op(r, OP_LOCK);
-    push_be32(r->b, locktype);
-    push_boolean(r->b, false); // reclaim
-    push_be64(r->b, offset);
-    push_be64(r->b, length);
+    rpc r = file_rpc(f, b);
+    push_lock(r, f, locktype, offset, length, false);
+    if (f->c->cache) push_attr_request(r, 1ull<<FATTR4_CHANGE);
+    return r;
+}
 
-    push_boolean(r->b, true); // new lock owner
-    push_bare_sequence(r);
-    push_stateid(r, &f->open_sid);
-    push_lock_sequence(r);
-    push_owner(r);
+rpc unlock_rpc(file f, buffer b, u32 locktype, u64 offset, u64 length)
+{
+    rpc r = file_rpc(f, b);
+    push_unlock(r, f, locktype, offset, length, false);
+    return r;
+}
 
-    buffer res = f->c->reverse;
-    status s = transact(r, OP_LOCK, res);
-    if (!is_ok(s)) return s;
-    parse_stateid(f->c, res, &f->latest_sid);
-    return STATUS_OK;
+status lock_complete(rpc r)
+{
+    readahead_drop(r->f);
+    status s = lock_stateid(r->f, r->result);
+    if (!is_ok(s) || !r->c->cache) return s;
+    s = parse_change(r->f, r->result);
+    r->f->validated = is_ok(s);
+    return s;
+}
+
+// nothing stops the file changing once any part of the lock is gone
+status unlock_complete(rpc r)
+{
+    r->f->validated = false;
+    readahead_drop(r->f);
+    return lock_stateid(r->f, r->result);
+}
+
+// section 18.3, rfc 5661 - the whole file
+status commit(file f, u8 *verifier)
+{
+    client c = f->c;
+    client_lock(c);
+    rpc r = file_rpc(f, 0);
+    push_op(r, OP_COMMIT);
+    push_be64(r->b, 0); // offset
+    push_be32(r->b, 0); // count
+    status s = transact(r, OP_COMMIT, r->result);
+    if (is_ok(s)) s = read_buffer(c, r->result, verifier, NFS4_VERIFIER_SIZE);
+    deallocate_rpc(r);
+    client_unlock(c);
+    return s;
+}
+
+// section 18.30, rfc 5661. held writes are committed first, so a
+// resend can't put back what was cut off
+status file_truncate(file f, u64 length)
+{
+    client c = f->c;
+    client_lock(c);
+    readahead_drop(f);
+    status s = file_sync_locked(f);
+    if (is_ok(s)) {
+        rpc r = file_rpc(f, 0);
+        push_op(r, OP_SETATTR);
+        push_stateid(r, &f->latest_sid);
+        struct fattr a = {.mask = 1ull<<FATTR4_SIZE, .size = length};
+        push_fattr(r->b, &a);
+        s = transact(r, OP_SETATTR, r->result);
+        deallocate_rpc(r);
+    }
+    cache_invalidate(f);
+    client_unlock(c);
+    return s;
+}
+
+// section 18.6, rfc 5661
+status return_delegation(file f)
+{
+    client c = f->c;
+    client_lock(c);
+    rpc r = file_rpc(f, 0);
+    push_op(r, OP_DELEGRETURN);
+    push_stateid(r, &f->delegation);
+    status s = transact(r, OP_DELEGRETURN, r->result);
+    deallocate_rpc(r);
+    f->delegation_type = OPEN_DELEGATE_NONE;
+    client_unlock(c);
+    return s;
+}
+
+status lock_range(file f, u32 locktype, u64 offset, u64 length)
+{
+    struct lock_step l = {.unlock = false, .locktype = locktype, .offset = offset, .length = length};
+    int done;
+    return lock_steps(f, &l, 1, &done);
 }
 
 status unlock_range(file f, u32 locktype, u64 offset, u64 length)
 {
-    rpc r = file_rpc(f);
-    push_op(r, OP_LOCKU);
-    push_be32(r->b, locktype);
-    push_bare_sequence(r);
-    push_stateid(r, &f->latest_sid);
-    push_be64(r->b, offset);
-    push_be64(r->b, length);
-    buffer res = f->c->reverse;
-    status s = transact(r, OP_LOCKU, res);
+    client_lock(f->c);
+    // other clients can see them once they're on the server
+    status fs = flush_writes(f);
+    if (!is_ok(fs)) {
+        client_unlock(f->c);
+        return fs;
+    }
+    rpc r = unlock_rpc(f, 0, locktype, offset, length);
+    status s = transact(r, OP_LOCKU, r->result);
+    if (is_ok(s)) s = unlock_complete(r);
+    deallocate_rpc(r);
+    client_unlock(f->c);
+    return s;
+}
+
+// the op and status ahead of each chained step
+static status step_result(rpc r, buffer res, u32 op)
+{
+    u32 which;
+    status s = next_result(r, res, &which);
+    if (is_ok(s) && (which != op)) return allocate_status(r->c, "encoding mismatch");
+    return s;
+}
+
+static rpc steps_rpc(file f, lock_step steps, int count, boolean locking)
+{
+    rpc r = file_rpc(f, 0);
+    for (int i = 0; i < count; i++) {
+        lock_step l = steps + i;
+        if (l->unlock) push_unlock(r, f, l->locktype, l->offset, l->length, i > 0);
+        else push_lock(r, f, l->locktype, l->offset, l->length, i > 0);
+    }
+    if (locking && f->c->cache) push_attr_request(r, 1ull<<FATTR4_CHANGE);
+    return r;
+}
+
+// a run of lock changes on one file in a single compound, each one after
+// the first on the lock stateid the one before left. the server stops at
+// the first failure, and done is how many went through
+status lock_steps(file f, lock_step steps, int count, int *done)
+{
+    client c = f->c;
+    boolean locking = false, unlocking = false;
+    *done = 0;
+    for (int i = 0; i < count; i++) {
+        if (steps[i].unlock) unlocking = true;
+        else locking = true;
+    }
+    client_lock(c);
+    readahead_drop(f);
+    // other clients can see them once they're on the server
+    status s = unlocking ? flush_writes(f) : STATUS_OK;
+    if (!is_ok(s)) {
+        client_unlock(c);
+        return s;
+    }
+    boolean known = lock_owner_known(f);
+    u32 generation = c->generation;
+    rpc r = steps_rpc(f, steps, count, locking);
+    s = transact(r, steps[0].unlock ? OP_LOCKU : OP_LOCK, r->result);
+    // the session was replaced on the way, and the lock stateid it went
+    // out with means nothing on the new one. built again it starts over
+    // with a new lock owner
+    if (!is_ok(s) && known && (c->generation != generation)) {
+        deallocate_rpc(r);
+        r = steps_rpc(f, steps, count, locking);
+        s = transact(r, steps[0].unlock ? OP_LOCKU : OP_LOCK, r->result);
+    }
+    buffer res = r->result;
+    // the steps before the one that failed are held whatever the compound
+    // status says. there's more to read only if the first went through
+    status ps = (is_ok(s) || r->following) ? STATUS_OK : s;
+    for (int i = 0; is_ok(ps) && (i < count); i++) {
+        if (i > 0) ps = step_result(r, res, steps[i].unlock ? OP_LOCKU : OP_LOCK);
+        if (is_ok(ps)) ps = lock_stateid(f, res);
+        if (is_ok(ps)) (*done)++;
+    }
+    if (is_ok(s)) s = ps;
+    // the change is read after the last step, so it's good for
+    // whatever is still held
+    f->validated = false;
+    if (is_ok(s) && locking && c->cache) {
+        s = parse_change(f, res);
+        f->validated = is_ok(s);
+    }
+    deallocate_rpc(r);
+    client_unlock(c);
+    return s;
+}
+
+// batches - independent operations packed into as few compounds as
+// maxops and the negotiated request and reply sizes allow
+
+// room left in a compound for everything other than the payloads
+#define BATCH_SLACK 1024
+
+// a compound built by batch_flush, covering entries [first, last)
+typedef struct compound {
+    rpc r;
+    int first, last;
+    boolean barrier; // a stateid from this is needed by later entries
+    boolean sent;
+} *compound;
+
+batch allocate_batch(client c)
+{
+    batch bt = allocate(c->h, sizeof(struct batch));
+    bt->c = c;
+    bt->entries = allocate_vector(c->h, c->maxops);
+    bt->last = 0;
+    return bt;
+}
+
+static batch_entry batch_push(batch bt, file f, u32 op, void *data, u64 offset, u64 length)
+{
+    batch_entry e = allocate(bt->c->h, sizeof(struct batch_entry));
+    e->f = f;
+    e->op = op;
+    e->data = data;
+    e->offset = offset;
+    e->length = length;
+    e->locktype = 0;
+    e->size = 0;
+    e->stable = FILE_SYNC4;
+    e->result = 0;
+    vector_push(bt->entries, e);
+    return e;
+}
+
+void batch_read(batch bt, file f, void *dest, u64 offset, u32 length)
+{
+    bt->last = vector_length(bt->entries);
+    u32 chunk = bt->c->maxresp - BATCH_SLACK;
+    for (u32 done = 0; done < length; done += chunk)
+        batch_push(bt, f, OP_READ, dest + done, offset + done, MIN(length - done, chunk));
+}
+
+void batch_write(batch bt, file f, void *source, u64 offset, u32 length)
+{
+    bt->last = vector_length(bt->entries);
+    u32 chunk = bt->c->maxreq - BATCH_SLACK;
+    for (u32 done = 0; done < length; done += chunk)
+        batch_push(bt, f, OP_WRITE, source + done, offset + done, MIN(length - done, chunk));
+}
+
+// the data has to be committed, the verifiers are noted on the file
+void batch_write_unstable(batch bt, file f, void *source, u64 offset, u32 length)
+{
+    bt->last = vector_length(bt->entries);
+    u32 chunk = bt->c->maxreq - BATCH_SLACK;
+    for (u32 done = 0; done < length; done += chunk)
+        batch_push(bt, f, OP_WRITE, source + done, offset + done,
+                   MIN(length - done, chunk))->stable = UNSTABLE4;
+}
+
+void batch_size(batch bt, file f, u64 *size)
+{
+    bt->last = vector_length(bt->entries);
+    batch_push(bt, f, OP_GETATTR, 0, 0, 0)->size = size;
+}
+
+void batch_lock(batch bt, file f, u32 locktype, u64 offset, u64 length)
+{
+    bt->last = vector_length(bt->entries);
+    batch_push(bt, f, OP_LOCK, 0, offset, length)->locktype = locktype;
+}
+
+void batch_unlock(batch bt, file f, u32 locktype, u64 offset, u64 length)
+{
+    bt->last = vector_length(bt->entries);
+    batch_push(bt, f, OP_LOCKU, 0, offset, length)->locktype = locktype;
+}
+
+void batch_status(batch bt, status *s)
+{
+    *s = allocate_status(bt->c, "not run");
+    for (int i = bt->last; i < vector_length(bt->entries); i++)
+        ((batch_entry)vector_get(bt->entries, i))->result = s;
+}
+
+static boolean same_fh(file a, file b)
+{
+    return a && b && (a->filehandle_len == b->filehandle_len) &&
+        !memcmp(a->filehandle, b->filehandle, a->filehandle_len);
+}
+
+static boolean used_later(batch bt, file f, int from)
+{
+    for (int i = from; i < vector_length(bt->entries); i++)
+        if (same_fh(f, ((batch_entry)vector_get(bt->entries, i))->f)) return true;
+    return false;
+}
+
+// upper bounds on what an entry adds to the request and the reply
+static bytes entry_request(batch_entry e)
+{
+    return 128 + ((e->op == OP_WRITE) ? pad(e->length, 4) : 0);
+}
+
+static bytes entry_reply(batch_entry e)
+{
+    return 64 + ((e->op == OP_READ) ? pad(e->length, 4) : 0);
+}
+
+// pack entries starting at *next into one compound. the current filehandle
+// carries over between entries on the same file, and if a file is left
+// and comes back later its kept with SAVEFH so the return is a RESTOREFH.
+// a LOCK or LOCKU ends the compound if anything after it is on the same
+// file, since that needs the new lock stateid
+static compound batch_compound(batch bt, int *next)
+{
+    client c = bt->c;
+    if (!c->compounds) c->compounds = allocate_freelist(c->h, sizeof(struct compound));
+    compound k = allocate(c->compounds, sizeof(struct compound));
+    rpc r = allocate_rpc(c, get_buffer(c));
+    r->result = get_buffer(c);
+    push_sequence(r);
+    k->r = r;
+    k->first = *next;
+    k->barrier = false;
+    k->sent = false;
+
+    file current = 0, saved = 0;
+    bytes request = length(r->b), reply = RPC_REPLY_HEADER + SEQUENCE_REPLY;
+    while (*next < vector_length(bt->entries)) {
+        batch_entry e = vector_get(bt->entries, *next);
+        boolean save = false;
+        int fhops = 0;
+        if (!same_fh(e->f, current)) {
+            fhops++;
+            if (current && !saved && !same_fh(e->f, saved) && used_later(bt, current, *next + 1)) {
+                save = true;
+                fhops++;
+            }
+        }
+        bytes rq = entry_request(e) + fhops * (8 + NFS4_FHSIZE);
+        bytes rp = entry_reply(e) + fhops * EMPTY_OP_REPLY;
+        if ((*next > k->first) &&
+            ((r->opcount + fhops + 1 > c->maxops) ||
+             (request + rq > c->maxreq) || (reply + rp > c->maxresp)))
+            break;
+
+        if (!same_fh(e->f, current)) {
+            if (save) {
+                push_op(r, OP_SAVEFH);
+                saved = current;
+            }
+            if (same_fh(e->f, saved)) {
+                push_op(r, OP_RESTOREFH);
+            } else {
+                push_op(r, OP_PUTFH);
+                push_string(r->b, (char *)e->f->filehandle, e->f->filehandle_len);
+            }
+            current = e->f;
+        }
+        switch (e->op) {
+        case OP_READ:
+            push_read(r, e->f, e->offset, e->length);
+            break;
+        case OP_WRITE:
+            push_write(r, e->f, e->data, e->offset, e->length, e->stable);
+            break;
+        case OP_GETATTR:
+            push_attr_request(r, 1ull<<FATTR4_SIZE);
+            break;
+        case OP_LOCK:
+            push_lock(r, e->f, e->locktype, e->offset, e->length, false);
+            break;
+        case OP_LOCKU:
+            push_unlock(r, e->f, e->locktype, e->offset, e->length, false);
+            break;
+        }
+        request += rq;
+        reply += rp;
+        (*next)++;
+        if (((e->op == OP_LOCK) || (e->op == OP_LOCKU)) && used_later(bt, e->f, *next)) {
+            k->barrier = true;
+            break;
+        }
+    }
+    k->last = *next;
+    return k;
+}
+
+static void deallocate_compound(compound k)
+{
+    client c = k->r->c;
+    put_buffer(c, k->r->b);
+    put_buffer(c, k->r->result);
+    deallocate_rpc(k->r);
+    deallocate(c->compounds, k, sizeof(struct compound));
+}
+
+static status parse_entry(client c, batch_entry e, buffer b)
+{
+    switch (e->op) {
+    case OP_READ: {
+        read_beu32(c, b); // eof
+        u32 len = read_beu32(c, b);
+        if (len > e->length) return allocate_status(c, "read overrun");
+        status s = read_buffer(c, b, e->data, len);
+        b->start += pad(len, 4) - len;
+        return s;
+    }
+    case OP_WRITE: {
+        u32 count = read_beu32(c, b);
+        read_beu32(c, b); // committed
+        if (length(b) < NFS4_VERIFIER_SIZE) return allocate_status(c, "out of data");
+        if (e->stable == UNSTABLE4) write_verifier(e->f, b->contents + b->start);
+        b->start += NFS4_VERIFIER_SIZE;
+        if (count != e->length) return allocate_status(c, "short write");
+        return STATUS_OK;
+    }
+    case OP_GETATTR: {
+        struct fattr a;
+        status s = parse_fattr(c, b, &a);
+        if (is_ok(s) && !(a.mask & (1ull<<FATTR4_SIZE)))
+            s = allocate_status(c, "size missing from attributes");
+        *e->size = a.size;
+        return s;
+    }
+    case OP_LOCK:
+    case OP_LOCKU:
+        return lock_stateid(e->f, b);
+    }
+    return allocate_status(c, "unhandled batch op");
+}
+
+// an operation split over several entries is done with its last one,
+// and the server stops at the first failure, so a failure is kept
+static void entry_done(batch bt, int i, status s)
+{
+    batch_entry e = vector_get(bt->entries, i);
+    if (!e->result) return;
+    if (!is_ok(s) || (i + 1 == vector_length(bt->entries)) ||
+        (((batch_entry)vector_get(bt->entries, i + 1))->result != e->result))
+        *e->result = s;
+}
+
+// walk the results in the compound in order, handing the ones for
+// entries to parse_entry. the server stops at the first failure, and
+// the entries before it are parsed all the same
+static status batch_results(batch bt, compound k, boolean *badsession)
+{
+    client c = bt->c;
+    buffer b = k->r->result;
+    status s = parse_rpc(k->r, b, badsession);
     if (!is_ok(s)) return s;
-    parse_stateid(f->c, res, &f->latest_sid);
+    int i = k->first;
+    while (k->r->following) {
+        u32 op;
+        s = next_result(k->r, b, &op);
+        boolean entry = (i < k->last) && (op == ((batch_entry)vector_get(bt->entries, i))->op);
+        if (is_ok(s)) s = entry ? parse_entry(c, vector_get(bt->entries, i), b) : parse_result(k->r, b, op);
+        if (entry) entry_done(bt, i++, s);
+        if (!is_ok(s)) return s;
+    }
+    if (k->r->nstatus != NFS4_OK) return allocate_status(c, codestring(nfsstatus, k->r->nstatus));
     return STATUS_OK;
 }
+
+// keeps up to io_depth compounds in flight and retires them in order.
+// a bad session or a dead connection reconnects and resends everything
+// outstanding. the entries are cleared whatever the outcome, and the
+// first error is returned - entries after a failure may not have run
+status batch_flush(batch bt)
+{
+    client c = bt->c;
+    client_lock(c);
+    vector inflight = get_buffer(c);
+    int next = 0, recoveries = 0;
+    boolean barrier = false, failed = false;
+    status s = STATUS_OK;
+    compound k;
+
+    while (is_ok(s) && ((next < vector_length(bt->entries)) || vector_length(inflight))) {
+        while (!failed && !barrier && (next < vector_length(bt->entries)) &&
+               (vector_length(inflight) < c->io_depth)) {
+            k = batch_compound(bt, &next);
+            vector_push(inflight, k);
+            barrier = k->barrier;
+            failed = !is_ok(rpc_send(k->r));
+            k->sent = !failed;
+        }
+
+        k = vector_get(inflight, 0);
+        boolean badsession = false;
+        if (!failed) failed = !is_ok(rpc_wait(k->r));
+        if (!failed) s = batch_results(bt, k, &badsession);
+        if (failed || badsession) {
+            if (recoveries++ > 1) {
+                s = allocate_status(c, "session recovery failed");
+                break;
+            }
+            s = rpc_connection(c);
+            failed = false;
+            vector_foreach(k, inflight) {
+                if (!is_ok(s) || failed) break;
+                replay_rpc(k->r);
+                failed = !is_ok(rpc_send(k->r));
+                k->sent = !failed;
+            }
+            continue;
+        }
+        vector_pop(inflight);
+        if (k->barrier) barrier = false;
+        deallocate_compound(k);
+    }
+
+    // on error there may be compounds still in flight which refer to the buffers
+    while (vector_length(inflight)) {
+        k = vector_pop(inflight);
+        if (k->sent && !is_ok(rpc_wait(k->r))) abort_pending(c);
+        deallocate_compound(k);
+    }
+    status zs = zerocopy_wait(c);
+    if (is_ok(s)) s = zs;
+    batch_entry e;
+    vector_foreach(e, bt->entries)
+        deallocate(c->h, e, sizeof(struct batch_entry));
+    bt->entries->start = bt->entries->end = 0;
+    put_buffer(c, inflight);
+    client_unlock(c);
+    return s;
+}
+
+void deallocate_batch(batch bt)
+{
+    batch_entry e;
+    vector_foreach(e, bt->entries)
+        deallocate(bt->c->h, e, sizeof(struct batch_entry));
+    deallocate_buffer(bt->entries);
+    deallocate(bt->c->h, bt, sizeof(struct batch));
+}
@@ -10,7 +10,6 @@ typedef unsigned char u8;
 typedef unsigned int u32;
 typedef unsigned long u64;
 typedef u32 bytes;
-typedef void *heap;
 
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a):(b))
@@ -20,8 +19,28 @@ typedef void *heap;
 #define MAX(a, b) ((a) > (b) ? (a):(b))
 #endif
 
-#define allocate(__h, __b) (malloc(__b))
-#define deallocate(__h, __x, __len) (free(__x))
+// a zero heap is plain malloc and free
+typedef struct heap {
+    void *(*alloc)(struct heap *h, bytes b);
+    void (*dealloc)(struct heap *h, void *x, bytes b);
+    void (*destroy)(struct heap *h);
+} *heap;
+
+static inline void *allocate(heap h, bytes b)
+{
+    return h ? h->alloc(h, b) : malloc(b);
+}
+
+static inline void deallocate(heap h, void *x, bytes b)
+{
+    if (h) h->dealloc(h, x, b);
+    else free(x);
+}
+
+static inline void destroy(heap h)
+{
+    h->destroy(h);
+}
 
 #ifndef eprintf
 #define eprintf(format, ...) fprintf (stdout, format, ## __VA_ARGS__); fflush(stdout)
@@ -34,6 +53,7 @@ static inline void panic (char *cause)
     abort();
 }
 
+#include <heap.h>
 #include <buffer.h>
 #include <vector.h>
 #include <status.h>
@@ -0,0 +1,131 @@
+#include <nfs4.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <codepoint.h>
+#include <nfs4xdr.h>
+#include "fake.h"
+
+// the page cache against another client's writes: pages are used while
+// a lock is held, checked against the change attribute when the next
+// one is taken, and fetched pages stay put through all of it
+
+#define PAGE 4096
+
+static void fill(u8 *x, u8 v)
+{
+    memset(x, v, PAGE);
+}
+
+struct fetch {
+    file f;
+    u64 offset;
+    void *page;
+    status s;
+};
+
+static void *fetch(void *x)
+{
+    struct fetch *t = x;
+    t->s = fetchfile(t->f, t->offset, PAGE, &t->page);
+    return 0;
+}
+
+int main()
+{
+    setenv("NFS_CACHE_PAGES", "4", 1);
+    setenv("NFS_READAHEAD", "false", 1);
+    fake_start();
+    client c;
+    check(is_ok(create_client("127.0.0.1", &c)));
+    file f;
+    check(is_ok(file_create(c, fake_path("cached"), &f)));
+    u8 page[PAGE], got[PAGE];
+    for (int i = 0; i < 6; i++) {
+        fill(page, i);
+        check(is_ok(writefile(f, page, i * PAGE, PAGE, SYNCH_COMMIT)));
+    }
+
+    // reads under a lock are served from the cache after the first
+    check(is_ok(lock_range(f, READ_LT, 0, 1)));
+    check(is_ok(readfile(f, got, 0, PAGE)));
+    u32 reads = fake.reads;
+    check(is_ok(readfile(f, got, 0, PAGE)));
+    check(fake.reads == reads);
+    check(got[0] == 0);
+
+    // someone else writes, the next lock sees the change and drops the page
+    fill(page, 0x10);
+    fake_write("cached", page, 0, PAGE);
+    check(is_ok(unlock_range(f, READ_LT, 0, 1)));
+    check(is_ok(lock_range(f, READ_LT, 0, 1)));
+    check(is_ok(readfile(f, got, 0, PAGE)));
+    check(fake.reads == reads + 1);
+    check(got[0] == 0x10);
+
+    // a write without the cache trusted forgets what the pages were
+    // checked against, so the next lock doesn't take them as current
+    check(is_ok(unlock_range(f, READ_LT, 0, 1)));
+    fill(page, 0x20);
+    check(is_ok(writefile(f, page, 100, 10, SYNCH_COMMIT)));
+    fill(page, 0x30);
+    fake_write("cached", page, 200, 10);
+    check(is_ok(lock_range(f, READ_LT, 0, 1)));
+    check(is_ok(readfile(f, got, 0, PAGE)));
+    check((got[100] == 0x20) && (got[200] == 0x30) && (got[0] == 0x10));
+
+    // a fetched page outlives its invalidation and eviction
+    void *fetched;
+    check(is_ok(fetchfile(f, PAGE, PAGE, &fetched)));
+    check(fetched && (((u8 *)fetched)[0] == 1));
+    check(!((unsigned long)fetched % sysconf(_SC_PAGESIZE)));
+    fill(page, 0x40);
+    fake_write("cached", page, PAGE, PAGE);
+    check(is_ok(unlock_range(f, READ_LT, 0, 1)));
+    check(is_ok(lock_range(f, READ_LT, 0, 1)));
+    for (int i = 2; i < 6; i++) check(is_ok(readfile(f, got, i * PAGE, PAGE)));
+    check(((u8 *)fetched)[0] == 1 && ((u8 *)fetched)[PAGE - 1] == 1);
+    void *again;
+    check(is_ok(fetchfile(f, PAGE, PAGE, &again)));
+    check(again && (again != fetched) && (((u8 *)again)[0] == 0x40));
+    unfetchfile(f, PAGE, fetched);
+    unfetchfile(f, PAGE, again);
+
+    // more files than pages, the records of them are bounded with the pages
+    for (int i = 0; i < 8; i++) {
+        char name[16];
+        sprintf(name, "many%d", i);
+        file g;
+        check(is_ok(file_create(c, fake_path(name), &g)));
+        fill(page, i);
+        check(is_ok(writefile(g, page, 0, PAGE, SYNCH_COMMIT)));
+        check(is_ok(lock_range(g, READ_LT, 0, 1)));
+        check(is_ok(readfile(g, got, 0, PAGE)));
+        check(got[0] == i);
+        check(is_ok(unlock_range(g, READ_LT, 0, 1)));
+        check(is_ok(file_close(g)));
+    }
+
+    // a page being fetched isn't there for another thread's read until
+    // it's filled
+    fill(page, 0x55);
+    fake_write("cached", page, 5 * PAGE, PAGE);
+    fake.delay_op = OP_READ;
+    fake.delay = 200 * 1000;
+    struct fetch t = {.f = f, .offset = 5 * PAGE};
+    pthread_t th;
+    pthread_create(&th, 0, fetch, &t);
+    usleep(50 * 1000);
+    check(is_ok(readfile(f, got, 5 * PAGE, PAGE)));
+    check((got[0] == 0x55) && (got[PAGE - 1] == 0x55));
+    pthread_join(th, 0);
+    fake.delay_op = 0;
+    check(is_ok(t.s) && t.page && (((u8 *)t.page)[0] == 0x55));
+    unfetchfile(f, 5 * PAGE, t.page);
+
+    check(is_ok(unlock_range(f, READ_LT, 0, 1)));
+    check(is_ok(file_close(f)));
+    client_destroy(c);
+    printf("check_cache ok\n");
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include <nfs4.h>
+#include <stdio.h>
+#include "fake.h"
+
+// held writes: nothing goes out until a sync, a server restart between
+// the writes and the COMMIT has them sent again, and if they can't be
+// committed close says so instead of dropping them
+
+#define SIZE (64 * 1024)
+
+static void expect(client c, char *name, u8 v)
+{
+    static u8 got[SIZE];
+    file f;
+    check(is_ok(file_open_read(c, fake_path(name), &f)));
+    check(is_ok(readfile(f, got, 0, SIZE)));
+    for (int i = 0; i < SIZE; i++) check(got[i] == v);
+    check(is_ok(file_close(f)));
+}
+
+int main()
+{
+    setenv("NFS_WRITE_BEHIND", "8388608", 1);
+    fake_start();
+    client c, other;
+    check(is_ok(create_client("127.0.0.1", &c)));
+    check(is_ok(create_client("127.0.0.1", &other)));
+    static u8 data[SIZE];
+    file f;
+    check(is_ok(file_create(c, fake_path("held"), &f)));
+
+    memset(data, 1, SIZE);
+    u32 writes = fake.writes, commits = fake.commits;
+    for (int i = 0; i < SIZE; i += 4096)
+        check(is_ok(writefile(f, data + i, i, 4096, SYNCH_LOCAL)));
+    check(fake.writes == writes);
+    check(is_ok(file_sync(f)));
+    check(fake.writes > writes);
+    check(fake.commits == commits + 1);
+    expect(other, "held", 1);
+
+    // the verifier changes at the COMMIT, so everything goes again
+    memset(data, 2, SIZE);
+    check(is_ok(writefile(f, data, 0, SIZE, SYNCH_LOCAL)));
+    writes = fake.writes;
+    commits = fake.commits;
+    fake.restart_on_commit = 1;
+    check(is_ok(file_sync(f)));
+    check(fake.commits == commits + 2);
+    check(fake.writes >= writes + 2);
+    expect(other, "held", 2);
+
+    // it never sticks, close fails rather than losing them quietly
+    memset(data, 3, SIZE);
+    check(is_ok(writefile(f, data, 0, SIZE, SYNCH_LOCAL)));
+    fake.restart_on_commit = 1000;
+    check(!is_ok(file_sync(f)));
+    check(!is_ok(file_close(f)));
+    fake.restart_on_commit = 0;
+
+    // and a clean close commits what's held
+    check(is_ok(file_open_write(c, fake_path("held"), &f)));
+    memset(data, 4, SIZE);
+    check(is_ok(writefile(f, data, 0, SIZE, SYNCH_LOCAL)));
+    commits = fake.commits;
+    check(is_ok(file_close(f)));
+    check(fake.commits == commits + 1);
+    expect(other, "held", 4);
+
+    // a write that fails part way through, the ones before it went
+    // through and aren't sent again
+    check(is_ok(file_open_write(c, fake_path("held"), &f)));
+    memset(data, 5, SIZE);
+    for (int i = 0; i < SIZE; i += 4096)
+        check(is_ok(writefile(f, data + i, i, 4096, SYNCH_LOCAL)));
+    writes = fake.writes;
+    fake.fail_write = 4;
+    check(!is_ok(file_sync(f)));
+    check(fake.writes >= writes + 4);
+    writes = fake.writes;
+    check(is_ok(file_sync(f)));
+    check(fake.writes == writes + SIZE / 4096 - 3);
+    check(is_ok(file_close(f)));
+    expect(other, "held", 5);
+
+    client_destroy(c);
+    client_destroy(other);
+    printf("check_commit ok\n");
+    return 0;
+}
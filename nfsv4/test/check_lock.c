@@ -0,0 +1,148 @@
+#include <nfs4.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "fake.h"
+
+// lock owners across a new session, and sqlite's SHARED lock being kept
+// past the end of a read transaction with NFS_LAZY_UNLOCK
+
+int sqlite3_nfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi);
+
+#define PENDING_BYTE 0x40000000
+#define SHARED_FIRST (PENDING_BYTE + 2)
+#define SHARED_SIZE 510
+
+static int run(sqlite3 *db, char *sql)
+{
+    return sqlite3_exec(db, sql, 0, 0, 0);
+}
+
+// a lock stateid from before the session was replaced isn't sent again,
+// the next lock starts a new owner on the new client id
+static void owners(client c, client other)
+{
+    file f, g;
+    check(is_ok(file_create(c, fake_path("owners"), &f)));
+    u32 owners = fake.owners;
+    check(is_ok(lock_range(f, READ_LT, 0, 1)));
+    check(is_ok(lock_range(f, READ_LT, 1, 1)));
+    check(fake.owners == owners + 1);
+
+    fake_drop_sessions();
+    u64 size;
+    check(is_ok(file_size(f, &size)));
+    check(is_ok(lock_range(f, READ_LT, 2, 1)));
+    check(is_ok(lock_range(f, READ_LT, 3, 1)));
+    check(fake.owners == owners + 2);
+
+    // and when the session goes while the lock is on its way
+    fake_drop_sessions();
+    check(is_ok(lock_range(f, READ_LT, 4, 1)));
+    check(fake.owners == owners + 3);
+
+    // the other client can't write under them until they're gone
+    check(is_ok(file_open_write(other, fake_path("owners"), &g)));
+    u32 denied = fake.denied;
+    check(!is_ok(lock_range(g, WRITE_LT, 4, 1)));
+    check(fake.denied == denied + 1);
+    check(is_ok(unlock_range(f, READ_LT, 4, 1)));
+    check(is_ok(lock_range(g, WRITE_LT, 4, 1)));
+    check(is_ok(unlock_range(g, WRITE_LT, 4, 1)));
+    check(is_ok(file_close(g)));
+    check(is_ok(file_close(f)));
+}
+
+// the first step goes through and the second is denied, the first is
+// still held and counted
+static void partial(client c, client other)
+{
+    file f, g;
+    check(is_ok(file_create(c, fake_path("partial"), &f)));
+    check(is_ok(file_open_write(other, fake_path("partial"), &g)));
+    check(is_ok(lock_range(g, WRITE_LT, 1, 1)));
+    struct lock_step steps[] = {
+        {.unlock = false, .locktype = READ_LT, .offset = 0, .length = 1},
+        {.unlock = false, .locktype = READ_LT, .offset = 1, .length = 1},
+    };
+    int done;
+    check(!is_ok(lock_steps(f, steps, 2, &done)));
+    check(done == 1);
+    check(fake_locks("partial") == 2);
+    check(is_ok(unlock_range(f, READ_LT, 0, 1)));
+    check(fake_locks("partial") == 1);
+    check(is_ok(unlock_range(g, WRITE_LT, 1, 1)));
+    check(is_ok(file_close(g)));
+    check(is_ok(file_close(f)));
+}
+
+static void lazy(client other)
+{
+    sqlite3 *db;
+    check(sqlite3_open_v2("127.0.0.1/lazy.db", &db,
+                          SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, "nfs4") == SQLITE_OK);
+    check(run(db, "create table t(x); insert into t values(1)") == SQLITE_OK);
+
+    // the SHARED lock outlives the transaction
+    check(run(db, "select count(*) from t") == SQLITE_OK);
+    check(fake_locks("lazy.db") == 1);
+
+    // and the next one only has to get past the pending byte
+    u32 locks = fake.locks, unlocks = fake.unlocks;
+    check(run(db, "select count(*) from t") == SQLITE_OK);
+    check(fake.locks == locks + 1);
+    check(fake.unlocks == unlocks + 1);
+    check(fake_locks("lazy.db") == 1);
+
+    // which a writer waiting on the readers holds, so it's turned away
+    // and lets its shared range go
+    file w;
+    check(is_ok(file_open_write(other, fake_path("lazy.db"), &w)));
+    check(is_ok(lock_range(w, WRITE_LT, PENDING_BYTE, 1)));
+    check(run(db, "select count(*) from t") != SQLITE_OK);
+    check(fake_locks("lazy.db") == 1);
+    check(is_ok(unlock_range(w, WRITE_LT, PENDING_BYTE, 1)));
+    check(is_ok(file_close(w)));
+
+    // the reaper lets it go once it's expired
+    check(run(db, "select count(*) from t") == SQLITE_OK);
+    check(fake_locks("lazy.db") == 1);
+    usleep(500 * 1000);
+    check(fake_locks("lazy.db") == 0);
+
+    // a reader that gets the pending byte but not the shared range,
+    // because a writer has it, lets the pending byte go again
+    check(is_ok(file_open_write(other, fake_path("lazy.db"), &w)));
+    check(is_ok(lock_range(w, WRITE_LT, SHARED_FIRST, SHARED_SIZE)));
+    check(run(db, "select count(*) from t") != SQLITE_OK);
+    check(fake_locks("lazy.db") == 1);
+    check(is_ok(unlock_range(w, WRITE_LT, SHARED_FIRST, SHARED_SIZE)));
+    check(is_ok(file_close(w)));
+
+    check(sqlite3_close(db) == SQLITE_OK);
+}
+
+int main()
+{
+    setenv("NFS_LAZY_UNLOCK", "100", 1);
+    fake_start();
+    client c, other;
+    check(is_ok(create_client("127.0.0.1", &c)));
+    check(is_ok(create_client("127.0.0.1", &other)));
+    owners(c, other);
+    partial(c, other);
+
+    // registers the vfs for the connections after this one. only once,
+    // it would find itself as the default vfs to pass things on to
+    sqlite3_auto_extension((void (*)(void))sqlite3_nfs_init);
+    sqlite3 *db;
+    check(sqlite3_open(":memory:", &db) == SQLITE_OK);
+    sqlite3_cancel_auto_extension((void (*)(void))sqlite3_nfs_init);
+    sqlite3_close(db);
+    lazy(other);
+
+    client_destroy(c);
+    client_destroy(other);
+    printf("check_lock ok\n");
+    return 0;
+}
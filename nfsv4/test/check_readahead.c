@@ -0,0 +1,62 @@
+#include <nfs4.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <codepoint.h>
+#include <nfs4xdr.h>
+#include "fake.h"
+
+// sequential reads are served from windows fetched ahead of them, and
+// a file closed while its windows are still on the wire waits for them
+// before it goes
+
+#define PAGE 4096
+#define SIZE (256 * 1024)
+
+static u8 data[SIZE];
+
+int main()
+{
+    setenv("NFS_READAHEAD_MIN", "16384", 1);
+    setenv("NFS_READAHEAD_MAX", "16384", 1);
+    fake_start();
+    client c;
+    check(is_ok(create_client("127.0.0.1", &c)));
+    for (int i = 0; i < SIZE; i++) data[i] = i / PAGE;
+    file f, g;
+    check(is_ok(file_create(c, fake_path("scan"), &f)));
+    check(is_ok(writefile(f, data, 0, SIZE, SYNCH_COMMIT)));
+    check(is_ok(file_create(c, fake_path("other"), &g)));
+    check(is_ok(writefile(g, data, 0, SIZE, SYNCH_COMMIT)));
+
+    // a run gets windows ahead of it, and the reads after come out of them
+    u8 got[PAGE];
+    for (int i = 0; i < 3; i++) check(is_ok(readfile(f, got, i * PAGE, PAGE)));
+    u32 reads = fake.reads;
+    for (int i = 3; i < 6; i++) {
+        check(is_ok(readfile(f, got, i * PAGE, PAGE)));
+        check((got[0] == i) && (got[PAGE - 1] == i));
+    }
+    check(fake.reads == reads);
+
+    // nothing is left reading into it once it's closed
+    fake.delay_op = OP_READ;
+    fake.delay = 200 * 1000;
+    check(is_ok(readfile(f, got, 6 * PAGE, PAGE)));
+    check(is_ok(readfile(f, got, 12 * PAGE, PAGE)));
+    check(is_ok(readfile(f, got, 13 * PAGE, PAGE)));
+    check(is_ok(file_close(f)));
+    reads = fake.reads;
+    usleep(300 * 1000);
+    check(fake.reads == reads);
+    fake.delay_op = 0;
+
+    // and the next file's reads don't run into what's left of it
+    for (int i = 0; i < 6; i++) {
+        check(is_ok(readfile(g, got, i * PAGE, PAGE)));
+        check((got[0] == i) && (got[PAGE - 1] == i));
+    }
+    check(is_ok(file_close(g)));
+    client_destroy(c);
+    printf("check_readahead ok\n");
+    return 0;
+}
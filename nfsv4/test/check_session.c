@@ -0,0 +1,181 @@
+#include <nfs4.h>
+#include <codepoint.h>
+#include <nfs4xdr.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "fake.h"
+
+// the vfs keeping sessions per server between connections, and the end
+// of session setup going out with the first open
+
+int sqlite3_nfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi);
+
+#define CONCURRENT 4
+
+static sqlite3 *open_db(char *name)
+{
+    sqlite3 *db;
+    check(sqlite3_open_v2(name, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, "nfs4") == SQLITE_OK);
+    return db;
+}
+
+static void *open_close(void *x)
+{
+    sqlite3_close(open_db(x));
+    return 0;
+}
+
+// up to NFS_SESSIONS of them, shared past that and kept after the
+// files close, until they've been idle for NFS_SESSION_IDLE
+static void registry()
+{
+    u32 sessions = fake.sessions, destroyed = fake.destroyed;
+    sqlite3 *a = open_db("127.0.0.1/a.db");
+    check(fake.sessions == sessions + 1);
+    sqlite3 *b = open_db("127.0.0.1/b.db");
+    check(fake.sessions == sessions + 2);
+    sqlite3 *c = open_db("127.0.0.1/c.db");
+    check(fake.sessions == sessions + 2);
+    sqlite3_close(a);
+    sqlite3_close(b);
+    sqlite3_close(c);
+    sqlite3_close(open_db("127.0.0.1/a.db"));
+    check(fake.sessions == sessions + 2);
+    check(fake.destroyed == destroyed);
+
+    // the next open lets them go and starts again
+    usleep(1200 * 1000);
+    sqlite3_close(open_db("127.0.0.1/a.db"));
+    check(fake.destroyed == destroyed + 2);
+    check(fake.sessions == sessions + 3);
+}
+
+// opens that come in while the first session is being set up wait for
+// it instead of each making their own
+static void concurrent()
+{
+    u32 sessions = fake.sessions;
+    fake.delay_op = OP_CREATE_SESSION;
+    fake.delay = 200 * 1000;
+    pthread_t t[CONCURRENT];
+    char names[CONCURRENT][32];
+    for (int i = 0; i < CONCURRENT; i++) {
+        sprintf(names[i], "localhost/concurrent%d.db", i);
+        pthread_create(t + i, 0, open_close, names[i]);
+    }
+    for (int i = 0; i < CONCURRENT; i++) pthread_join(t[i], 0);
+    fake.delay_op = 0;
+    check(fake.sessions == sessions + 2);
+}
+
+// a server that isn't there fails the open, and leaves nothing behind
+// to wait on for the next one
+static void unreachable()
+{
+    sqlite3 *db;
+    for (int i = 0; i < 2; i++) {
+        check(sqlite3_open_v2("nohost.invalid/x.db", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, "nfs4") != SQLITE_OK);
+        sqlite3_close(db);
+    }
+}
+
+struct opener {
+    client c;
+    char name[32];
+    status s;
+};
+
+static void *open_file(void *x)
+{
+    struct opener *o = x;
+    file f;
+    o->s = file_create(o->c, fake_path(o->name), &f);
+    if (is_ok(o->s)) o->s = file_close(f);
+    return 0;
+}
+
+// RECLAIM_COMPLETE isn't sent until there's an open to carry it, and
+// only the one time
+static void bootstrap()
+{
+    u32 reclaims = fake.reclaims;
+    client c;
+    check(is_ok(create_client("127.0.0.1", &c)));
+    check(fake.reclaims == reclaims);
+    u32 compounds = fake.compounds;
+    file f;
+    check(is_ok(file_create(c, fake_path("carried"), &f)));
+    check(fake.compounds == compounds + 1);
+    check(fake.reclaims == reclaims + 1);
+    check(is_ok(file_close(f)));
+    client_destroy(c);
+
+    // the open behind the carrier waits for its reply, an OPEN that got
+    // there first would be turned away in the grace period
+    reclaims = fake.reclaims;
+    check(is_ok(create_client("127.0.0.1", &c)));
+    fake.delay_op = OP_RECLAIM_COMPLETE;
+    fake.delay = 200 * 1000;
+    pthread_t t[CONCURRENT];
+    struct opener openers[CONCURRENT];
+    for (int i = 0; i < CONCURRENT; i++) {
+        openers[i].c = c;
+        sprintf(openers[i].name, "waited%d", i);
+        pthread_create(t + i, 0, open_file, openers + i);
+    }
+    for (int i = 0; i < CONCURRENT; i++) pthread_join(t[i], 0);
+    fake.delay_op = 0;
+    for (int i = 0; i < CONCURRENT; i++) check(is_ok(openers[i].s));
+    check(fake.reclaims == reclaims + 1);
+    client_destroy(c);
+
+    // a carrier that meets a dead session goes again on the new one
+    reclaims = fake.reclaims;
+    check(is_ok(create_client("127.0.0.1", &c)));
+    fake_drop_sessions();
+    struct opener replayed = {.c = c, .name = "replayed"};
+    open_file(&replayed);
+    check(is_ok(replayed.s));
+    check(fake.reclaims == reclaims + 1);
+
+    // and a session replaced under a client that's past it sets up the
+    // rest by itself
+    fake_drop_sessions();
+    check(is_ok(file_open_read(c, fake_path("replayed"), &f)));
+    check(fake.reclaims == reclaims + 2);
+    check(is_ok(file_close(f)));
+
+    // and if the server says it's been done already, it has
+    fake.reclaimed = true;
+    fake_drop_sessions();
+    check(is_ok(file_open_read(c, fake_path("replayed"), &f)));
+    check(fake.reclaims == reclaims + 3);
+    check(is_ok(file_close(f)));
+    fake.reclaimed = false;
+    client_destroy(c);
+}
+
+int main()
+{
+    setenv("NFS_SESSIONS", "2", 1);
+    setenv("NFS_SESSION_IDLE", "1", 1);
+    // so an OPEN can get to the server ahead of the RECLAIM_COMPLETE
+    setenv("NFS_CONNECTIONS", "2", 1);
+    fake_start();
+    bootstrap();
+
+    // registers the vfs for the connections after this one. only once,
+    // it would find itself as the default vfs to pass things on to
+    sqlite3_auto_extension((void (*)(void))sqlite3_nfs_init);
+    sqlite3 *db;
+    check(sqlite3_open(":memory:", &db) == SQLITE_OK);
+    sqlite3_cancel_auto_extension((void (*)(void))sqlite3_nfs_init);
+    sqlite3_close(db);
+    registry();
+    concurrent();
+    unreachable();
+    printf("check_session ok\n");
+    return 0;
+}
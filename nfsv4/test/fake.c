@@ -0,0 +1,731 @@
+#include <nfs4_internal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <errno.h>
+#include "fake.h"
+
+// just enough of an nfsv4.1 server for the client to run against in
+// the tests. files are kept in memory in one flat directory, and each
+// connection gets a thread of its own, with every compound served under
+// one lock. it keeps the rules the client has to get right: OPEN isn't
+// allowed before RECLAIM_COMPLETE, there's only one RECLAIM_COMPLETE per
+// client id, lock stateids are tied to the client id they came from and
+// locks from different owners conflict. open stateids aren't checked,
+// the client doesn't reclaim its opens across a new session.
+// anything it doesn't understand ends the test
+
+struct fake fake;
+
+#define FAKE_FILES 64
+#define ROOT 0
+
+static struct fake_file {
+    char name[64];
+    buffer contents;
+    u64 change;
+} files[FAKE_FILES]; // a filehandle is the index, and 0 is the root
+static u32 nfiles = 1;
+
+typedef struct fake_client {
+    u64 id;
+    boolean reclaimed;
+} *fake_client;
+
+typedef struct fake_session {
+    fake_client c;
+    u32 slots;
+    boolean dropped;
+} *fake_session;
+
+// a lock owner on one file, whose stateid is the index
+typedef struct lock_state {
+    fake_client c;
+    u32 file;
+    char owner[64];
+    u32 seq;
+} *lock_state;
+
+// what the ops of one compound hand on to the ones after them
+typedef struct compound {
+    fake_session session;
+    fake_client c;
+    u32 current, saved; // filehandles
+    lock_state state; // the current stateid, if it's a lock's
+} *compound;
+
+typedef struct held {
+    u32 state;
+    u32 file;
+    u32 type;
+    u64 start, end;
+} *held;
+
+static pthread_mutex_t fake_lock = PTHREAD_MUTEX_INITIALIZER;
+static vector clients, sessions, states, locks;
+static u64 next_client = 0x100;
+static u64 verifier = 1;
+
+static void bad(char *what, u32 x)
+{
+    printf("fake server: %s %d\n", what, x);
+    exit(1);
+}
+
+static u32 get32(buffer b)
+{
+    if (length(b) < 4) bad("short call", length(b));
+    u32 v;
+    memcpy(&v, b->contents + b->start, 4);
+    b->start += 4;
+    return ntohl(v);
+}
+
+static u64 get64(buffer b)
+{
+    u64 h = get32(b);
+    return (h << 32) | get32(b);
+}
+
+// opaques and fixed strings are padded to a word
+static void *get_bytes(buffer b, u32 len)
+{
+    if (length(b) < pad(len, 4)) bad("short opaque", len);
+    void *x = b->contents + b->start;
+    b->start += pad(len, 4);
+    return x;
+}
+
+static u32 get_opaque(buffer b, void **x)
+{
+    u32 len = get32(b);
+    *x = get_bytes(b, len);
+    return len;
+}
+
+static void push_fh(buffer b, u32 file)
+{
+    push_be32(b, 8);
+    push_be32(b, 0xfa4e);
+    push_be32(b, file);
+}
+
+static u32 get_fh(buffer b)
+{
+    void *x;
+    if (get_opaque(b, &x) != 8) bad("filehandle", 0);
+    u32 file = ntohl(((u32 *)x)[1]);
+    if (file >= nfiles) bad("filehandle", file);
+    return file;
+}
+
+// the other part is a tag, an index and the low bits of the client id
+static void push_sid(buffer b, u32 seq, u32 tag, u32 index, fake_client c)
+{
+    push_be32(b, seq);
+    push_be32(b, tag);
+    push_be32(b, index);
+    push_be32(b, c->id);
+}
+
+// a sequence of one and a zero other is whatever the op before left
+static lock_state get_lock_sid(buffer b, compound k)
+{
+    u32 seq = get32(b), tag = get32(b), index = get32(b), id = get32(b);
+    if ((seq == 1) && !tag && !index && !id) return k->state;
+    if ((tag != 'L') || (index >= vector_length(states))) return 0;
+    lock_state s = vector_get(states, index);
+    if ((s->c != k->c) || ((u32)k->c->id != id)) return 0;
+    return s;
+}
+
+static u32 lookup(char *name, u32 len)
+{
+    for (u32 i = 1; i < nfiles; i++)
+        if ((strlen(files[i].name) == len) && !memcmp(files[i].name, name, len))
+            return i;
+    return 0;
+}
+
+static u32 find_file(char *name)
+{
+    u32 i = lookup(name, strlen(name));
+    if (!i) bad("no such file", 0);
+    return i;
+}
+
+static u32 create_file(char *name, u32 len)
+{
+    if ((nfiles == FAKE_FILES) || (len >= sizeof(files[0].name))) bad("too many files", nfiles);
+    struct fake_file *f = files + nfiles;
+    memcpy(f->name, name, len);
+    f->name[len] = 0;
+    f->contents = allocate_buffer(0, 4096);
+    f->change = 1;
+    return nfiles++;
+}
+
+static void file_extend(struct fake_file *f, u64 end)
+{
+    if (end <= f->contents->end) return;
+    buffer_extend(f->contents, end - f->contents->end);
+    memset(f->contents->contents + f->contents->end, 0, end - f->contents->end);
+    f->contents->end = end;
+}
+
+static void push_change_info(buffer out, u32 file)
+{
+    push_boolean(out, true);
+    push_be64(out, files[file].change - 1);
+    push_be64(out, files[file].change);
+}
+
+#define SUPPORTED ((1ull<<FATTR4_TYPE) | (1ull<<FATTR4_CHANGE) | (1ull<<FATTR4_SIZE) |\
+                   (1ull<<FATTR4_LEASE_TIME) | (1ull<<FATTR4_MODE))
+
+static void push_attrs(buffer out, u32 file, u64 mask)
+{
+    mask &= SUPPORTED;
+    push_be32(out, 2);
+    push_be32(out, mask);
+    push_be32(out, mask >> 32);
+    bytes lenloc = out->end;
+    push_be32(out, 0);
+    if (mask & (1ull<<FATTR4_TYPE)) push_be32(out, file == ROOT ? 2 : 1);
+    if (mask & (1ull<<FATTR4_CHANGE)) push_be64(out, files[file].change);
+    if (mask & (1ull<<FATTR4_SIZE)) push_be64(out, file == ROOT ? 0 : files[file].contents->end);
+    if (mask & (1ull<<FATTR4_LEASE_TIME)) push_be32(out, 90);
+    if (mask & (1ull<<FATTR4_MODE)) push_be32(out, 0644);
+    *(u32 *)(out->contents + lenloc) = htonl(out->end - lenloc - 4);
+}
+
+// the attributes sent with a create or setattr, only the size is used
+static u64 get_attrs(buffer b, u64 *size)
+{
+    u32 words = get32(b);
+    u64 mask = 0;
+    for (int i = 0; i < words; i++) {
+        u64 w = get32(b);
+        if (i < 2) mask |= w << (32 * i);
+    }
+    u32 len = get32(b);
+    struct buffer v = {.contents = get_bytes(b, len), .start = 0, .end = len};
+    if (mask & (1ull<<FATTR4_CHANGE)) get64(&v);
+    if (mask & (1ull<<FATTR4_SIZE)) *size = get64(&v);
+    return mask;
+}
+
+static boolean writer(u32 type)
+{
+    return (type == WRITE_LT) || (type == WRITEW_LT);
+}
+
+// the owner's hold on [start, end) goes away, what's either side stays
+static void subtract(u32 state, u64 start, u64 end)
+{
+    for (int i = vector_length(locks) - 1; i >= 0; i--) {
+        held h = vector_get(locks, i);
+        if ((h->state != state) || (h->end <= start) || (h->start >= end)) continue;
+        if (h->start < start) {
+            held left = allocate(0, sizeof(struct held));
+            *left = *h;
+            left->end = start;
+            vector_push(locks, left);
+        }
+        if (h->end > end) {
+            held right = allocate(0, sizeof(struct held));
+            *right = *h;
+            right->start = end;
+            vector_push(locks, right);
+        }
+        vector_remove(locks, h);
+        deallocate(0, h, sizeof(struct held));
+    }
+}
+
+static u64 range_end(u64 offset, u64 length)
+{
+    return ((length == ~0ull) || (offset + length < offset)) ? ~0ull : offset + length;
+}
+
+static u32 serve_lock(buffer in, buffer out, compound k)
+{
+    fake_client c = k->c;
+    u32 file = k->current;
+    u32 type = get32(in);
+    get32(in); // reclaim
+    u64 offset = get64(in), length = get64(in);
+    u64 end = range_end(offset, length);
+    lock_state s = 0;
+    if (get32(in)) {
+        get32(in); // open seqid
+        get_bytes(in, 16); // open stateid
+        get32(in); // lock seqid
+        get_bytes(in, 8); // client id
+        char *owner;
+        u32 len = get_opaque(in, (void **)&owner);
+        if (len >= sizeof(s->owner)) bad("lock owner", len);
+        lock_state i;
+        vector_foreach(i, states)
+            if ((i->c == c) && (i->file == file) && (strlen(i->owner) == len) && !memcmp(i->owner, owner, len))
+                s = i;
+        if (!s) {
+            s = allocate(0, sizeof(struct lock_state));
+            memset(s, 0, sizeof(struct lock_state));
+            s->c = c;
+            s->file = file;
+            memcpy(s->owner, owner, len);
+            vector_push(states, s);
+            fake.owners++;
+        }
+    } else {
+        s = get_lock_sid(in, k);
+        get32(in); // lock seqid
+        if (!s) return NFS4ERR_BAD_STATEID;
+    }
+    fake.locks++;
+    u32 index;
+    for (index = 0; vector_get(states, index) != s; index++);
+    held h;
+    vector_foreach(h, locks) {
+        if ((h->file != file) || (h->state == index)) continue;
+        if ((h->end <= offset) || (h->start >= end)) continue;
+        if (!writer(h->type) && !writer(type)) continue;
+        fake.denied++;
+        push_be64(out, h->start);
+        push_be64(out, h->end - h->start);
+        push_be32(out, h->type);
+        push_be64(out, 0);
+        push_be32(out, 0);
+        return NFS4ERR_DENIED;
+    }
+    subtract(index, offset, end);
+    h = allocate(0, sizeof(struct held));
+    h->state = index;
+    h->file = file;
+    h->type = type;
+    h->start = offset;
+    h->end = end;
+    vector_push(locks, h);
+    push_sid(out, ++s->seq, 'L', index, c);
+    k->state = s;
+    return NFS4_OK;
+}
+
+static u32 serve_unlock(buffer in, buffer out, compound k)
+{
+    fake_client c = k->c;
+    get32(in); // type
+    get32(in); // seqid
+    lock_state s = get_lock_sid(in, k);
+    u64 offset = get64(in), length = get64(in);
+    if (!s) return NFS4ERR_BAD_STATEID;
+    fake.unlocks++;
+    u32 index;
+    for (index = 0; vector_get(states, index) != s; index++);
+    subtract(index, offset, range_end(offset, length));
+    push_sid(out, ++s->seq, 'L', index, c);
+    k->state = s;
+    return NFS4_OK;
+}
+
+static u32 serve_open(buffer in, buffer out, compound k)
+{
+    fake_client c = k->c;
+    get32(in); // seqid
+    get32(in); // share access
+    get32(in); // share deny
+    get_bytes(in, 8); // client id
+    void *x;
+    get_opaque(in, &x); // owner
+    boolean create = get32(in) == OPEN4_CREATE;
+    u64 size = ~0ull;
+    if (create) {
+        if (get32(in) != UNCHECKED4) bad("create mode", 0);
+        get_attrs(in, &size);
+    }
+    if (get32(in) != CLAIM_NULL) bad("open claim", 0);
+    char *name;
+    u32 len = get_opaque(in, (void **)&name);
+    if (k->current != ROOT) return NFS4ERR_NOTDIR;
+    if (!c->reclaimed) return NFS4ERR_GRACE;
+    fake.opens++;
+    u32 file = lookup(name, len);
+    if (!file && !create) return NFS4ERR_NOENT;
+    if (!file) file = create_file(name, len);
+    k->current = file;
+    push_sid(out, 1, 'O', file, c);
+    k->state = 0;
+    push_change_info(out, ROOT);
+    push_be32(out, 0); // rflags
+    push_be32(out, 0); // attrset
+    push_be32(out, OPEN_DELEGATE_NONE);
+    return NFS4_OK;
+}
+
+// one op, its arguments are taken off in and its results put on out
+static u32 serve_op(u32 op, buffer in, buffer out, compound k)
+{
+    void *x;
+    switch (op) {
+    case OP_EXCHANGE_ID: {
+        get_bytes(in, NFS4_VERIFIER_SIZE);
+        get_opaque(in, &x); // owner id
+        get32(in); // flags
+        if (get32(in) != SP4_NONE) bad("state protection", 0);
+        for (u32 n = get32(in); n; n--) {
+            get_opaque(in, &x);
+            get_opaque(in, &x);
+            get64(in);
+            get32(in);
+        }
+        fake.exchanges++;
+        fake_client n = allocate(0, sizeof(struct fake_client));
+        n->id = next_client++;
+        n->reclaimed = fake.reclaimed;
+        vector_push(clients, n);
+        push_bytes(out, &n->id, sizeof(n->id));
+        push_be32(out, 1); // sequence
+        push_be32(out, 0); // flags
+        push_be32(out, SP4_NONE);
+        push_be64(out, 0); // minor id
+        push_string(out, "fake", 4); // major id
+        push_string(out, "fake", 4); // scope
+        push_be32(out, 0); // impl id
+        return NFS4_OK;
+    }
+    case OP_CREATE_SESSION: {
+        u64 id;
+        memcpy(&id, get_bytes(in, 8), 8);
+        get32(in); // sequence
+        get32(in); // flags
+        u32 attrs[2][6];
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < 6; j++) attrs[i][j] = get32(in);
+            for (u32 n = get32(in); n; n--) get32(in); // rdma
+        }
+        get32(in); // callback program
+        for (u32 n = get32(in); n; n--)
+            if (get32(in) != 0) bad("callback security", 0);
+        fake_client owner = 0, i;
+        vector_foreach(i, clients) if (i->id == id) owner = i;
+        if (!owner) return NFS4ERR_STALE_CLIENTID;
+        fake.sessions++;
+        fake_session s = allocate(0, sizeof(struct fake_session));
+        s->c = owner;
+        s->slots = attrs[0][4];
+        s->dropped = false;
+        vector_push(sessions, s);
+        push_be32(out, 'S');
+        push_be32(out, vector_length(sessions) - 1);
+        push_be64(out, 0);
+        push_be32(out, 1); // sequence
+        push_be32(out, 0); // flags
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < 6; j++) push_be32(out, attrs[i][j]);
+            push_be32(out, 0);
+        }
+        return NFS4_OK;
+    }
+    case OP_SEQUENCE:
+    case OP_BIND_CONN_TO_SESSION:
+    case OP_DESTROY_SESSION: {
+        u32 *id = get_bytes(in, NFS4_SESSIONID_SIZE);
+        u32 index = ntohl(id[1]);
+        if ((ntohl(id[0]) != 'S') || (index >= vector_length(sessions))) return NFS4ERR_BADSESSION;
+        fake_session s = vector_get(sessions, index);
+        if (s->dropped) return NFS4ERR_BADSESSION;
+        k->session = s;
+        k->c = s->c;
+        if (op == OP_DESTROY_SESSION) {
+            s->dropped = true;
+            fake.destroyed++;
+            return NFS4_OK;
+        }
+        push_bytes(out, id, NFS4_SESSIONID_SIZE);
+        if (op == OP_BIND_CONN_TO_SESSION) {
+            push_be32(out, get32(in));
+            push_be32(out, get32(in));
+            return NFS4_OK;
+        }
+        push_be32(out, get32(in)); // sequence
+        push_be32(out, get32(in)); // slot
+        push_be32(out, get32(in)); // highest slot
+        get32(in); // cache this
+        push_be32(out, s->slots - 1);
+        push_be32(out, 0); // status flags
+        return NFS4_OK;
+    }
+    }
+    fake_client c = k->c;
+    if (!c) return NFS4ERR_OP_NOT_IN_SESSION;
+    switch (op) {
+    case OP_RECLAIM_COMPLETE:
+        get32(in);
+        fake.reclaims++;
+        if (c->reclaimed) return NFS4ERR_COMPLETE_ALREADY;
+        c->reclaimed = true;
+        return NFS4_OK;
+    case OP_PUTROOTFH:
+        k->current = ROOT;
+        return NFS4_OK;
+    case OP_PUTFH:
+        k->current = get_fh(in);
+        return NFS4_OK;
+    case OP_GETFH:
+        push_fh(out, k->current);
+        return NFS4_OK;
+    case OP_SAVEFH:
+        k->saved = k->current;
+        return NFS4_OK;
+    case OP_RESTOREFH:
+        k->current = k->saved;
+        return NFS4_OK;
+    case OP_LOOKUP: {
+        u32 len = get_opaque(in, &x);
+        fake.lookups++;
+        if (k->current != ROOT) return NFS4ERR_NOTDIR;
+        u32 file = lookup(x, len);
+        if (!file) return NFS4ERR_NOENT;
+        k->current = file;
+        return NFS4_OK;
+    }
+    case OP_GETATTR: {
+        u64 mask = 0;
+        u32 words = get32(in);
+        for (int i = 0; i < words; i++) {
+            u64 w = get32(in);
+            if (i < 2) mask |= w << (32 * i);
+        }
+        push_attrs(out, k->current, mask);
+        return NFS4_OK;
+    }
+    case OP_OPEN:
+        return serve_open(in, out, k);
+    case OP_READ: {
+        get_bytes(in, 16);
+        u64 offset = get64(in);
+        u32 count = get32(in);
+        buffer b = files[k->current].contents;
+        fake.reads++;
+        u32 n = offset < b->end ? MIN(count, b->end - offset) : 0;
+        push_boolean(out, offset + n >= b->end);
+        push_string(out, b->contents + offset, n);
+        return NFS4_OK;
+    }
+    case OP_WRITE: {
+        get_bytes(in, 16);
+        u64 offset = get64(in);
+        u32 stable = get32(in);
+        u32 len = get_opaque(in, &x);
+        struct fake_file *f = files + k->current;
+        fake.writes++;
+        if (fake.fail_write && !--fake.fail_write) return NFS4ERR_IO;
+        file_extend(f, offset + len);
+        memcpy(f->contents->contents + offset, x, len);
+        f->change++;
+        push_be32(out, len);
+        push_be32(out, stable ? FILE_SYNC4 : UNSTABLE4);
+        push_be64(out, verifier);
+        return NFS4_OK;
+    }
+    case OP_COMMIT:
+        get64(in);
+        get32(in);
+        fake.commits++;
+        if (fake.restart_on_commit) {
+            fake.restart_on_commit--;
+            verifier++;
+        }
+        push_be64(out, verifier);
+        return NFS4_OK;
+    case OP_SETATTR: {
+        get_bytes(in, 16);
+        u64 size = ~0ull;
+        u64 mask = get_attrs(in, &size);
+        if (size != ~0ull) {
+            struct fake_file *f = files + k->current;
+            if (size < f->contents->end) f->contents->end = size;
+            file_extend(f, size);
+            f->change++;
+        }
+        push_be32(out, 2);
+        push_be32(out, mask);
+        push_be32(out, mask >> 32);
+        return NFS4_OK;
+    }
+    case OP_REMOVE: {
+        u32 len = get_opaque(in, &x);
+        u32 file = lookup(x, len);
+        if (!file) return NFS4ERR_NOENT;
+        files[file].name[0] = 0;
+        files[ROOT].change++;
+        push_change_info(out, ROOT);
+        return NFS4_OK;
+    }
+    case OP_LOCK:
+        return serve_lock(in, out, k);
+    case OP_LOCKU:
+        return serve_unlock(in, out, k);
+    case OP_DELEGRETURN:
+        get_bytes(in, 16);
+        return NFS4_OK;
+    }
+    bad("unknown op", op);
+    return NFS4ERR_OP_ILLEGAL;
+}
+
+// the rpc header and compound arguments, then each op until one fails
+static void serve_compound(buffer in, buffer out)
+{
+    u32 xid = get32(in);
+    if (get32(in) != 0) bad("not a call", 0);
+    get32(in); // rpc version
+    if (get32(in) != NFS_PROGRAM) bad("program", 0);
+    get32(in); // version
+    get32(in); // procedure
+    void *x;
+    get32(in); // credential flavor
+    get_opaque(in, &x);
+    get32(in); // verifier flavor
+    get_opaque(in, &x);
+    get_opaque(in, &x); // tag
+    if (get32(in) != 1) bad("minor version", 0);
+    u32 count = get32(in);
+    push_be32(out, 0); // record mark
+    push_be32(out, xid);
+    push_be32(out, 1); // reply
+    push_be32(out, 0); // accepted
+    push_be32(out, 0); // verifier
+    push_be32(out, 0);
+    push_be32(out, 0); // success
+    bytes statusloc = out->end;
+    push_be32(out, NFS4_OK);
+    push_be32(out, 0); // tag
+    bytes countloc = out->end;
+    push_be32(out, 0);
+
+    fake.compounds++;
+    struct compound k = {.session = 0, .c = 0, .current = ROOT, .saved = ROOT, .state = 0};
+    u32 done = 0, status = NFS4_OK;
+    while ((done < count) && (status == NFS4_OK)) {
+        u32 op = get32(in);
+        // held up there with the lock let go, so the other connections
+        // get ahead of it
+        if (op == fake.delay_op) {
+            pthread_mutex_unlock(&fake_lock);
+            usleep(fake.delay);
+            pthread_mutex_lock(&fake_lock);
+        }
+        push_be32(out, op);
+        bytes oploc = out->end;
+        push_be32(out, NFS4_OK);
+        status = serve_op(op, in, out, &k);
+        *(u32 *)(out->contents + oploc) = htonl(status);
+        done++;
+    }
+    *(u32 *)(out->contents + statusloc) = htonl(status);
+    *(u32 *)(out->contents + countloc) = htonl(done);
+    *(u32 *)(out->contents + out->start) = htonl(0x80000000 | (length(out) - 4));
+}
+
+static boolean read_fully(int fd, void *x, u32 len)
+{
+    for (u32 n = 0; n < len; ) {
+        int r = read(fd, x + n, len - n);
+        if (r <= 0) return false;
+        n += r;
+    }
+    return true;
+}
+
+static void *serve(void *x)
+{
+    int fd = (int)(long)x;
+    buffer in = allocate_buffer(0, 64 * 1024), out = allocate_buffer(0, 64 * 1024);
+    u32 mark;
+    while (read_fully(fd, &mark, 4)) {
+        u32 len = ntohl(mark) & 0x7fffffff;
+        in->start = in->end = 0;
+        buffer_extend(in, len);
+        if (!read_fully(fd, in->contents, len)) break;
+        in->end = len;
+        out->start = out->end = 0;
+        pthread_mutex_lock(&fake_lock);
+        serve_compound(in, out);
+        pthread_mutex_unlock(&fake_lock);
+        if (write(fd, out->contents + out->start, length(out)) != length(out)) break;
+    }
+    close(fd);
+    deallocate_buffer(in);
+    deallocate_buffer(out);
+    return 0;
+}
+
+static void *listener(void *x)
+{
+    int s = (int)(long)x, fd;
+    pthread_t t;
+    while ((fd = accept(s, 0, 0)) >= 0)
+        if (!pthread_create(&t, 0, serve, (void *)(long)fd))
+            pthread_detach(t);
+    return 0;
+}
+
+void fake_start()
+{
+    clients = allocate_vector(0, 4);
+    sessions = allocate_vector(0, 4);
+    states = allocate_vector(0, 4);
+    locks = allocate_vector(0, 4);
+    files[ROOT].contents = allocate_buffer(0, 1);
+    files[ROOT].change = 1;
+    int s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in a = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof(a);
+    if (bind(s, (struct sockaddr *)&a, len) || listen(s, 16) ||
+        getsockname(s, (struct sockaddr *)&a, &len))
+        bad("listen", errno);
+    char port[16];
+    sprintf(port, "%d", ntohs(a.sin_port));
+    setenv("NFS_PORT", port, 1);
+    pthread_t t;
+    pthread_create(&t, 0, listener, (void *)(long)s);
+    pthread_detach(t);
+}
+
+void fake_drop_sessions()
+{
+    pthread_mutex_lock(&fake_lock);
+    fake_session s;
+    vector_foreach(s, sessions) s->dropped = true;
+    pthread_mutex_unlock(&fake_lock);
+}
+
+u32 fake_locks(char *name)
+{
+    pthread_mutex_lock(&fake_lock);
+    u32 file = find_file(name), n = 0;
+    held h;
+    vector_foreach(h, locks) if (h->file == file) n++;
+    pthread_mutex_unlock(&fake_lock);
+    return n;
+}
+
+// as if another client wrote it
+void fake_write(char *name, void *source, u64 offset, u32 length)
+{
+    pthread_mutex_lock(&fake_lock);
+    struct fake_file *f = files + find_file(name);
+    file_extend(f, offset + length);
+    memcpy(f->contents->contents + offset, source, length);
+    f->change++;
+    pthread_mutex_unlock(&fake_lock);
+}
+
+vector fake_path(char *name)
+{
+    struct buffer b = {.contents = name, .start = 0, .end = strlen(name)};
+    return split(0, &b, '/');
+}
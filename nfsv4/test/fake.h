@@ -0,0 +1,36 @@
+// an nfs server inside the test process, see fake.c
+
+struct fake {
+    // counted as they're served
+    u32 compounds, exchanges, sessions, destroyed, reclaims;
+    u32 opens, lookups, reads, writes, commits;
+    u32 locks, unlocks, denied, owners; // owners are new lock owners on a file
+    // the next this many COMMITs see a new write verifier, as if the
+    // server restarted and lost what was written unstable
+    u32 restart_on_commit;
+    // new client ids are already past RECLAIM_COMPLETE, as if one we
+    // gave up on had gotten in
+    boolean reclaimed;
+    // counted down by WRITEs, the one that takes it to zero fails
+    u32 fail_write;
+    // delay_op is served this many microseconds late, and the other
+    // connections are served meanwhile
+    u32 delay_op, delay;
+};
+
+extern struct fake fake;
+
+// listens on a loopback port and points NFS_PORT at it
+void fake_start();
+// every session is forgotten, the next request on one gets BADSESSION
+void fake_drop_sessions();
+// locks held on the file by anyone
+u32 fake_locks(char *name);
+void fake_write(char *name, void *source, u64 offset, u32 length);
+// the argument to file_open_read and the rest
+vector fake_path(char *name);
+
+#define check(__x) if (!(__x)) {\
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #__x);\
+    exit(1);\
+}
@@ -0,0 +1,364 @@
+#include <nfs4_internal.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <errno.h>
+
+// io_uring transport. writes are queued as linked SENDMSGs and go to
+// the kernel along with the next receive in a single io_uring_enter.
+// receives land in a registered per-connection staging buffer, so a burst
+// of small replies is picked up with one completion. payloads too large
+// to be worth staging are read directly into the caller's iovec.
+//
+// the request side is a gather list of header and caller fragments, so
+// there is no single forward buffer to register - the fixed buffer send
+// variants only exist for zerocopy
+
+#define URING_ENTRIES 64
+#define URING_STAGING (64 * 1024)
+#define RECEIVE_TAG (~0ull)
+
+struct send {
+    connection n;
+    struct msghdr m;
+    struct iovec v[1 + 3 * RPC_FRAGMENTS];
+    bytes length;
+    boolean busy;
+};
+
+typedef struct uring {
+    int fd;
+    u32 entries;
+    u32 *sq_head, *sq_tail, *sq_mask, *sq_array;
+    u32 *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq, *cq; // the mappings, for uring_release
+    bytes sq_size, cq_size, sqes_size;
+    u32 queued; // sqes not yet submitted
+    struct io_uring_sqe *last_send; // in the queued batch, for linking
+    u32 sending; // sends submitted but not completed
+    struct send sends[URING_ENTRIES];
+    boolean registered;
+    boolean received;
+    int result;
+} *uring;
+
+typedef struct staging {
+    u8 *contents;
+    bytes start, end;
+    u32 index; // of the registered buffer
+    boolean failed;
+} *staging;
+
+static int enter(uring u, u32 wait)
+{
+    u32 submit = u->queued;
+    u->queued = 0;
+    u->last_send = 0;
+    int res;
+    do {
+        res = syscall(__NR_io_uring_enter, u->fd, submit, wait,
+                      wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+    } while ((res < 0) && (errno == EINTR));
+    return res;
+}
+
+static void reap(uring u)
+{
+    u32 head = *u->cq_head;
+    while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *e = u->cqes + (head & *u->cq_mask);
+        if (e->user_data == RECEIVE_TAG) {
+            u->received = true;
+            u->result = e->res;
+        } else {
+            struct send *s = u->sends + e->user_data;
+            if (e->res != s->length)
+                ((staging)s->n->transport_state)->failed = true;
+            s->busy = false;
+            u->sending--;
+        }
+        head++;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *get_sqe(uring u)
+{
+    u32 tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->entries) {
+        enter(u, 0);
+        reap(u);
+    }
+    u32 index = tail & *u->sq_mask;
+    struct io_uring_sqe *q = u->sqes + index;
+    memset(q, 0, sizeof(struct io_uring_sqe));
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    return q;
+}
+
+static void wait_sends(uring u)
+{
+    while (u->sending) {
+        if (enter(u, 1) < 0) return;
+        reap(u);
+    }
+}
+
+static status uring_setup(client c)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0) return allocate_status(c, "io_uring_setup failed");
+
+    bytes sq_size = p.sq_off.array + p.sq_entries * sizeof(u32);
+    bytes cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bytes sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sq = mmap(0, sq_size,
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void *cq = mmap(0, cq_size,
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(0, sqes_size,
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if ((sq == MAP_FAILED) || (cq == MAP_FAILED) || (sqes == MAP_FAILED)) {
+        close(fd);
+        return allocate_status(c, "io_uring mmap failed");
+    }
+
+    uring u = allocate(c->h, sizeof(struct uring));
+    memset(u, 0, sizeof(struct uring));
+    u->fd = fd;
+    u->entries = p.sq_entries;
+    u->sq_head = sq + p.sq_off.head;
+    u->sq_tail = sq + p.sq_off.tail;
+    u->sq_mask = sq + p.sq_off.ring_mask;
+    u->sq_array = sq + p.sq_off.array;
+    u->cq_head = cq + p.cq_off.head;
+    u->cq_tail = cq + p.cq_off.tail;
+    u->cq_mask = cq + p.cq_off.ring_mask;
+    u->cqes = cq + p.cq_off.cqes;
+    u->sqes = sqes;
+    u->sq = sq;
+    u->cq = cq;
+    u->sq_size = sq_size;
+    u->cq_size = cq_size;
+    u->sqes_size = sqes_size;
+    c->transport_state = u;
+    return STATUS_OK;
+}
+
+// staging buffers are registered once all the connections have one,
+// index i belongs to connections[i]. without registration (i.e.
+// RLIMIT_MEMLOCK) we just use plain READs
+static void register_staging(client c, uring u)
+{
+    int count = vector_length(c->connections);
+    struct iovec v[count];
+    for (int i = 0; i < count; i++) {
+        staging st = ((connection)vector_get(c->connections, i))->transport_state;
+        v[i].iov_base = st->contents;
+        v[i].iov_len = URING_STAGING;
+    }
+    u->registered = !syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, v, count);
+}
+
+static status uring_attach(connection n)
+{
+    client c = n->c;
+    if (!c->transport_state) {
+        status s = uring_setup(c);
+        if (!is_ok(s)) return s;
+    }
+    if (!n->transport_state) {
+        staging st = allocate(c->h, sizeof(struct staging));
+        st->contents = allocate(c->h, URING_STAGING);
+        n->transport_state = st;
+        for (st->index = 0; vector_get(c->connections, st->index) != n; st->index++);
+    }
+    staging st = n->transport_state;
+    st->start = st->end = 0;
+    st->failed = false;
+    // the zerocopy completions are only collected from the blocking path
+    c->zerocopy = 0;
+    return STATUS_OK;
+}
+
+// nothing queued may refer to the socket once its closed
+static void uring_detach(connection n)
+{
+    uring u = n->c->transport_state;
+    if (u->queued) enter(u, 0);
+    wait_sends(u);
+    reap(u);
+}
+
+// the connections are all detached by now
+static void uring_release(client c)
+{
+    uring u = c->transport_state;
+    if (!u) return;
+    connection n;
+    vector_foreach(n, c->connections) {
+        staging st = n->transport_state;
+        if (!st) continue;
+        deallocate(c->h, st->contents, URING_STAGING);
+        deallocate(c->h, st, sizeof(struct staging));
+        n->transport_state = 0;
+    }
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->cq, u->cq_size);
+    munmap(u->sq, u->sq_size);
+    close(u->fd);
+    deallocate(c->h, u, sizeof(struct uring));
+    c->transport_state = 0;
+}
+
+static boolean uring_buffered(connection n)
+{
+    staging st = n->transport_state;
+    return st->end > st->start;
+}
+
+static status uring_flush(client c)
+{
+    uring u = c->transport_state;
+    if (u->queued && (enter(u, 0) < 0))
+        return allocate_status(c, "io_uring_enter failed");
+    reap(u);
+    return STATUS_OK;
+}
+
+// submit whatever is queued along with the receive and wait for it
+static int receive(uring u, struct io_uring_sqe *q)
+{
+    q->user_data = RECEIVE_TAG;
+    u->received = false;
+    while (!u->received) {
+        if (enter(u, 1) < 0) return -errno;
+        reap(u);
+    }
+    return u->result;
+}
+
+static int uring_readv(connection n, struct iovec *v, int count)
+{
+    client c = n->c;
+    uring u = c->transport_state;
+    staging st = n->transport_state;
+    int total = 0;
+
+    if (!u->registered) register_staging(c, u);
+    while (count) {
+        if (!v->iov_len) {
+            v++; count--;
+            continue;
+        }
+        if (st->failed) break;
+
+        bytes staged = st->end - st->start;
+        if (staged) {
+            bytes xfer = MIN(staged, v->iov_len);
+            memcpy(v->iov_base, st->contents + st->start, xfer);
+            st->start += xfer;
+            v->iov_base += xfer;
+            v->iov_len -= xfer;
+            total += xfer;
+            continue;
+        }
+
+        struct io_uring_sqe *q = get_sqe(u);
+        q->fd = n->fd;
+        q->off = -1;
+        boolean direct = v->iov_len >= URING_STAGING/2;
+        if (direct) {
+            q->opcode = IORING_OP_READV;
+            q->addr = (u64)v;
+            q->len = count;
+        } else {
+            q->opcode = u->registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            q->addr = (u64)st->contents;
+            q->len = URING_STAGING;
+            q->buf_index = st->index;
+        }
+        int res = receive(u, q);
+        if (res <= 0) {
+            eprintf("socket read error %s\n", res?strerror(-res):"closed");
+            st->failed = true;
+            break;
+        }
+        if (direct) {
+            total += res;
+            for (; count && (res >= v->iov_len); res -= v->iov_len, v++, count--);
+            if (count) {
+                v->iov_base += res;
+                v->iov_len -= res;
+            }
+        } else {
+            st->start = 0;
+            st->end = res;
+        }
+    }
+    if (st->failed) {
+        wait_sends(u);
+        return -1;
+    }
+    return total;
+}
+
+// queue the send, it gets submitted with the next receive or flush.
+// sends are linked so the kernel keeps them in order on the stream, and
+// a new batch waits for the previous one to finish for the same reason.
+// a failure shows up as a read error on the connection
+static int uring_writev(connection n, struct iovec *v, int count, int flags)
+{
+    uring u = n->c->transport_state;
+    staging st = n->transport_state;
+    if (st->failed) return -1;
+    if (!u->last_send) wait_sends(u);
+
+    struct send *s;
+    while (1) {
+        for (s = u->sends; (s < u->sends + URING_ENTRIES) && s->busy; s++);
+        if (s < u->sends + URING_ENTRIES) break;
+        if (enter(u, 1) < 0) return -1;
+        reap(u);
+    }
+    s->busy = true;
+    s->n = n;
+    s->length = 0;
+    for (int i = 0; i < count; i++) {
+        s->v[i] = v[i];
+        s->length += v[i].iov_len;
+    }
+    memset(&s->m, 0, sizeof(struct msghdr));
+    s->m.msg_iov = s->v;
+    s->m.msg_iovlen = count;
+
+    if (u->last_send) u->last_send->flags |= IOSQE_IO_LINK;
+    struct io_uring_sqe *q = get_sqe(u);
+    q->opcode = IORING_OP_SENDMSG;
+    q->fd = n->fd;
+    q->addr = (u64)&s->m;
+    q->len = 1;
+    q->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    q->user_data = s - u->sends;
+    u->last_send = q;
+    u->sending++;
+    return s->length;
+}
+
+struct transport uring_transport = {
+    "uring",
+    uring_attach,
+    uring_detach,
+    uring_readv,
+    uring_writev,
+    uring_buffered,
+    uring_flush,
+    uring_release
+};
@@ -40,6 +40,19 @@ static void *vector_pop(vector v)
     return res;
 }
 
+// unordered - the last element is moved into the hole
+static void vector_remove(vector v, void *i)
+{
+    for (int k = 0; k < vector_length(v); k++) {
+        if (vector_get(v, k) == i) {
+            v->end -= sizeof(void *);
+            memcpy(v->contents + v->start + k * sizeof(void *),
+                   v->contents + v->end, sizeof(void *));
+            return;
+        }
+    }
+}
+
 static vector split(heap h, buffer source, char divider)
 {
     vector result = allocate_vector(h, 10);
@@ -0,0 +1,159 @@
+#include <nfs4_internal.h>
+
+// write-behind. SYNCH_LOCAL writes are copied into extents and go to the
+// server as UNSTABLE4 when the file is synced, when a lock is released,
+// when the size is asked for, or when more than NFS_WRITE_BEHIND bytes
+// are held. the extents are kept until a COMMIT comes back with the same
+// verifier as the writes, since if the server restarts in between they
+// have to be sent again. extents are in the order they were written,
+// so replaying them in order gives the right contents where they overlap
+
+typedef struct extent {
+    u64 offset;
+    u32 length;
+    boolean sent;
+    status s; // of the write, in flush_writes
+    u8 data[];
+} *extent;
+
+static void deallocate_extent(file f, extent e)
+{
+    f->buffered -= e->length;
+    deallocate(f->c->h, e, sizeof(struct extent) + e->length);
+}
+
+static void mark_unsent(file f)
+{
+    extent e;
+    vector_foreach(e, f->extents) e->sent = false;
+    f->verifier_set = false;
+    f->verifier_changed = false;
+}
+
+void write_verifier(file f, u8 *verifier)
+{
+    if (f->verifier_set && memcmp(f->verifier, verifier, NFS4_VERIFIER_SIZE))
+        f->verifier_changed = true;
+    memcpy(f->verifier, verifier, NFS4_VERIFIER_SIZE);
+    f->verifier_set = true;
+}
+
+// a rewrite of the same range is done in place, as long as nothing
+// written since overlaps it
+static extent find_rewrite(file f, u64 offset, u32 length)
+{
+    for (int i = vector_length(f->extents) - 1; i >= 0; i--) {
+        extent e = vector_get(f->extents, i);
+        if ((e->offset == offset) && (e->length == length)) return e;
+        if ((e->offset < offset + length) && (offset < e->offset + e->length)) return 0;
+    }
+    return 0;
+}
+
+status flush_writes(file f)
+{
+    client c = f->c;
+    if (!f->extents) return STATUS_OK;
+    for (int tries = 0; tries < 2; tries++) {
+        batch bt = allocate_batch(c);
+        extent e;
+        vector_foreach(e, f->extents)
+            if (!e->sent) {
+                batch_write_unstable(bt, f, e->data, e->offset, e->length);
+                batch_status(bt, &e->s);
+            }
+        status s = batch_flush(bt);
+        deallocate_batch(bt);
+        // the verifiers of the ones that went through are noted, only
+        // the rest go again
+        vector_foreach(e, f->extents) if (!e->sent && is_ok(e->s)) e->sent = true;
+        if (!is_ok(s)) return s;
+        if (!f->verifier_changed) return STATUS_OK;
+        // the earlier writes may have been lost
+        mark_unsent(f);
+    }
+    return allocate_status(c, "write verifier keeps changing");
+}
+
+status write_behind(file f, void *source, u64 offset, u32 length, boolean send)
+{
+    client c = f->c;
+    if (!f->extents) f->extents = allocate_vector(c->h, 16);
+    extent e = find_rewrite(f, offset, length);
+    if (!e) {
+        e = allocate(c->h, sizeof(struct extent) + length);
+        e->offset = offset;
+        e->length = length;
+        vector_push(f->extents, e);
+        f->buffered += length;
+    }
+    memcpy(e->data, source, length);
+    e->sent = false;
+    if (f->buffered > c->write_behind)
+        return file_sync_locked(f);
+    if (send) return flush_writes(f);
+    return STATUS_OK;
+}
+
+status file_sync_locked(file f)
+{
+    client c = f->c;
+    if (!f->extents || !vector_length(f->extents)) return STATUS_OK;
+    for (int tries = 0; tries < 2; tries++) {
+        status s = flush_writes(f);
+        if (!is_ok(s)) return s;
+        u8 verifier[NFS4_VERIFIER_SIZE];
+        s = commit(f, verifier);
+        if (!is_ok(s)) return s;
+        if (!memcmp(verifier, f->verifier, NFS4_VERIFIER_SIZE)) {
+            extent e;
+            vector_foreach(e, f->extents) deallocate_extent(f, e);
+            f->extents->start = f->extents->end = 0;
+            f->verifier_set = false;
+            return STATUS_OK;
+        }
+        mark_unsent(f);
+    }
+    return allocate_status(c, "write verifier keeps changing");
+}
+
+status file_sync(file f)
+{
+    client_lock(f->c);
+    status s = file_sync_locked(f);
+    client_unlock(f->c);
+    return s;
+}
+
+// at close. whatever couldn't be committed is lost, and the caller
+// hears about it
+status release_writes(file f)
+{
+    if (!f->extents) return STATUS_OK;
+    status s = STATUS_OK;
+    if (vector_length(f->extents)) {
+        if (config_boolean("NFS_TRACE", false))
+            eprintf("dropping %lld uncommitted bytes\n", (long long)f->buffered);
+        s = allocate_status(f->c, "uncommitted writes lost");
+    }
+    extent e;
+    vector_foreach(e, f->extents) deallocate_extent(f, e);
+    deallocate_buffer(f->extents);
+    f->extents = 0;
+    return s;
+}
+
+// reads of ranges that haven't been sent yet see the held data. once
+// its on the server, someone else may have written over it since
+void overlay_writes(file f, void *dest, u64 offset, u32 length)
+{
+    if (!f->extents) return;
+    extent e;
+    vector_foreach(e, f->extents) {
+        if (e->sent) continue;
+        u64 start = MAX(e->offset, offset);
+        u64 end = MIN(e->offset + e->length, offset + length);
+        if (start < end)
+            memcpy(dest + (start - offset), e->data + (start - e->offset), end - start);
+    }
+}
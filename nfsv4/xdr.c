@@ -1,4 +1,5 @@
 #include <nfs4_internal.h>
+#include <stddef.h>
 
 void push_string(buffer b, char *x, u32 length) {
     u32 plen = pad(length, 4) - length;
@@ -23,6 +24,21 @@ void push_fixed_string(buffer b, char *x, u32 length) {
     }
 }
 
+// an opaque whose contents are sent from x by rpc_send rather than
+// copied into the buffer
+void push_fragment(rpc r, void *x, u32 length)
+{
+    if (r->fragment_count == RPC_FRAGMENTS) {
+        push_string(r->b, x, length);
+        return;
+    }
+    push_be32(r->b, length);
+    struct fragment *f = r->fragments + r->fragment_count++;
+    f->offset = r->b->end;
+    f->data = x;
+    f->length = length;
+}
+
 void push_channel_attrs(rpc r)
 {
     push_be32(r->b, 0); // headerpadsize
@@ -97,13 +113,10 @@ status parse_create_session(client c, buffer b)
 
 void push_sequence(rpc r)
 {
-    push_op(r, OP_SEQUENCE);
-    push_session_id(r, r->c->session);
-    push_be32(r->b, r->c->sequence);
-    push_be32(r->b, 0x00000000);  // slotid
-    push_be32(r->b, 0x00000000);  // highest slotid
-    push_be32(r->b, 0x00000000);  // sa_cachethis
-    r->c->sequence++;
+    // sequenceid, slotid and highest slotid are assigned in rpc_send
+    r->sequenceloc = r->b->end + SEQUENCE_SLOT_OFFSET;
+    push_bytes(r->b, r->c->sequence, SEQUENCE_TEMPLATE);
+    r->opcount++;
 }
 
 void push_bare_sequence(rpc r)
@@ -155,68 +168,359 @@ status parse_stateid(client c, buffer b, stateid sid)
     return s;
 }
 
+// results are described by tables keyed by the nfs4xdr.h op and
+// attribute numbers, so any op can be stepped over wherever it shows up
+// in a compound and attributes are decoded in whatever combination the
+// server returns
+enum {
+    X_DONE = 1, // 0 is an op we don't have a layout for
+    X_U32,
+    X_U64,
+    X_OPAQUE, // length and padded contents
+    X_STATEID,
+    X_VERIFIER,
+    X_SESSIONID,
+    X_BITMAP,
+    X_FATTR,
+    X_CHANGE_INFO,
+    X_DELEGATION, // open_delegation4 union
+    X_U32_ARRAY,
+};
+
+#define RESULT_FIELDS 7
+
+// the body of a successful result, after the status
+static u8 results[OP_CLONE + 1][RESULT_FIELDS] = {
+    [OP_ACCESS] = {X_U32, X_U32, X_DONE},
+    [OP_CLOSE] = {X_STATEID, X_DONE},
+    [OP_COMMIT] = {X_VERIFIER, X_DONE},
+    [OP_CREATE] = {X_CHANGE_INFO, X_BITMAP, X_DONE},
+    [OP_DELEGPURGE] = {X_DONE},
+    [OP_DELEGRETURN] = {X_DONE},
+    [OP_GETATTR] = {X_FATTR, X_DONE},
+    [OP_GETFH] = {X_OPAQUE, X_DONE},
+    [OP_LINK] = {X_CHANGE_INFO, X_DONE},
+    [OP_LOCK] = {X_STATEID, X_DONE},
+    [OP_LOCKT] = {X_DONE},
+    [OP_LOCKU] = {X_STATEID, X_DONE},
+    [OP_LOOKUP] = {X_DONE},
+    [OP_LOOKUPP] = {X_DONE},
+    [OP_NVERIFY] = {X_DONE},
+    [OP_OPEN] = {X_STATEID, X_CHANGE_INFO, X_U32, X_BITMAP, X_DELEGATION, X_DONE},
+    [OP_OPENATTR] = {X_DONE},
+    [OP_OPEN_DOWNGRADE] = {X_STATEID, X_DONE},
+    [OP_PUTFH] = {X_DONE},
+    [OP_PUTPUBFH] = {X_DONE},
+    [OP_PUTROOTFH] = {X_DONE},
+    [OP_READ] = {X_U32, X_OPAQUE, X_DONE},
+    [OP_READLINK] = {X_OPAQUE, X_DONE},
+    [OP_REMOVE] = {X_CHANGE_INFO, X_DONE},
+    [OP_RENAME] = {X_CHANGE_INFO, X_CHANGE_INFO, X_DONE},
+    [OP_RESTOREFH] = {X_DONE},
+    [OP_SAVEFH] = {X_DONE},
+    [OP_SETATTR] = {X_BITMAP, X_DONE},
+    [OP_VERIFY] = {X_DONE},
+    [OP_WRITE] = {X_U32, X_U32, X_VERIFIER, X_DONE},
+    [OP_RELEASE_LOCKOWNER] = {X_DONE},
+    [OP_BIND_CONN_TO_SESSION] = {X_SESSIONID, X_U32, X_U32, X_DONE},
+    [OP_DESTROY_SESSION] = {X_DONE},
+    [OP_FREE_STATEID] = {X_DONE},
+    [OP_SEQUENCE] = {X_SESSIONID, X_U32, X_U32, X_U32, X_U32, X_U32, X_DONE},
+    [OP_TEST_STATEID] = {X_U32_ARRAY, X_DONE},
+    [OP_DESTROY_CLIENTID] = {X_DONE},
+    [OP_RECLAIM_COMPLETE] = {X_DONE},
+    [OP_ALLOCATE] = {X_DONE},
+    [OP_DEALLOCATE] = {X_DONE},
+    [OP_IO_ADVISE] = {X_BITMAP, X_DONE},
+    [OP_SEEK] = {X_U32, X_U64, X_DONE},
+};
+
+// wire size of each attribute, and where it goes in struct fattr.
+// sizes of 12 are nfstime4, attributes with no entry stop decoding
+#define ATTR_OPAQUE -1
+#define ATTR_BITMAP -2
+#define NOWHERE -1
+#define field(__f) offsetof(struct fattr, __f)
+
+static struct attribute {
+    int size;
+    int offset;
+} attributes[64] = {
+    [FATTR4_SUPPORTED_ATTRS] = {ATTR_BITMAP, NOWHERE},
+    [FATTR4_TYPE] = {4, field(type)},
+    [FATTR4_FH_EXPIRE_TYPE] = {4, NOWHERE},
+    [FATTR4_CHANGE] = {8, field(change)},
+    [FATTR4_SIZE] = {8, field(size)},
+    [FATTR4_LINK_SUPPORT] = {4, NOWHERE},
+    [FATTR4_SYMLINK_SUPPORT] = {4, NOWHERE},
+    [FATTR4_NAMED_ATTR] = {4, NOWHERE},
+    [FATTR4_FSID] = {16, NOWHERE},
+    [FATTR4_UNIQUE_HANDLES] = {4, NOWHERE},
+    [FATTR4_LEASE_TIME] = {4, field(lease_time)},
+    [FATTR4_RDATTR_ERROR] = {4, NOWHERE},
+    [FATTR4_ACLSUPPORT] = {4, NOWHERE},
+    [FATTR4_ARCHIVE] = {4, NOWHERE},
+    [FATTR4_CANSETTIME] = {4, NOWHERE},
+    [FATTR4_CASE_INSENSITIVE] = {4, NOWHERE},
+    [FATTR4_CASE_PRESERVING] = {4, NOWHERE},
+    [FATTR4_CHOWN_RESTRICTED] = {4, NOWHERE},
+    [FATTR4_FILEHANDLE] = {ATTR_OPAQUE, NOWHERE},
+    [FATTR4_FILEID] = {8, field(fileid)},
+    [FATTR4_FILES_AVAIL] = {8, NOWHERE},
+    [FATTR4_FILES_FREE] = {8, NOWHERE},
+    [FATTR4_FILES_TOTAL] = {8, NOWHERE},
+    [FATTR4_HIDDEN] = {4, NOWHERE},
+    [FATTR4_HOMOGENEOUS] = {4, NOWHERE},
+    [FATTR4_MAXFILESIZE] = {8, NOWHERE},
+    [FATTR4_MAXLINK] = {4, NOWHERE},
+    [FATTR4_MAXNAME] = {4, NOWHERE},
+    [FATTR4_MAXREAD] = {8, NOWHERE},
+    [FATTR4_MAXWRITE] = {8, NOWHERE},
+    [FATTR4_MIMETYPE] = {ATTR_OPAQUE, NOWHERE},
+    [FATTR4_MODE] = {4, field(mode)},
+    [FATTR4_NO_TRUNC] = {4, NOWHERE},
+    [FATTR4_NUMLINKS] = {4, field(numlinks)},
+    [FATTR4_OWNER] = {ATTR_OPAQUE, NOWHERE},
+    [FATTR4_OWNER_GROUP] = {ATTR_OPAQUE, NOWHERE},
+    [FATTR4_QUOTA_AVAIL_HARD] = {8, NOWHERE},
+    [FATTR4_QUOTA_AVAIL_SOFT] = {8, NOWHERE},
+    [FATTR4_QUOTA_USED] = {8, NOWHERE},
+    [FATTR4_RAWDEV] = {8, NOWHERE},
+    [FATTR4_SPACE_AVAIL] = {8, NOWHERE},
+    [FATTR4_SPACE_FREE] = {8, NOWHERE},
+    [FATTR4_SPACE_TOTAL] = {8, NOWHERE},
+    [FATTR4_SPACE_USED] = {8, field(space_used)},
+    [FATTR4_SYSTEM] = {4, NOWHERE},
+    [FATTR4_TIME_ACCESS] = {12, NOWHERE},
+    [FATTR4_TIME_BACKUP] = {12, NOWHERE},
+    [FATTR4_TIME_CREATE] = {12, NOWHERE},
+    [FATTR4_TIME_DELTA] = {12, NOWHERE},
+    [FATTR4_TIME_METADATA] = {12, NOWHERE},
+    [FATTR4_TIME_MODIFY] = {12, field(modify)},
+    [FATTR4_MOUNTED_ON_FILEID] = {8, NOWHERE},
+};
+
+static status skip_opaque(client c, buffer b)
+{
+    u32 len = read_beu32(c, b);
+    if (length(b) < pad(len, 4)) return allocate_status(c, "out of data");
+    b->start += pad(len, 4);
+    return STATUS_OK;
+}
+
+// bitmaps of more than two words can only have attributes we don't know
+static status parse_bitmap(client c, buffer b, u64 *mask)
+{
+    u32 words = read_beu32(c, b);
+    u64 m = 0;
+    for (int i = 0; i < words; i++) {
+        u64 w = read_beu32(c, b);
+        if (i < 2) m |= w << (32 * i);
+    }
+    if (mask) *mask = m;
+    return STATUS_OK;
+}
+
+status parse_fattr(client c, buffer b, fattr a)
+{
+    u64 mask;
+    status s = parse_bitmap(c, b, &mask);
+    if (!is_ok(s)) return s;
+    u32 len = read_beu32(c, b);
+    if (length(b) < len) return allocate_status(c, "out of data");
+    bytes end = b->start + len;
+    a->mask = 0;
+    for (int i = 0; mask && (i < 64); i++) {
+        if (!(mask & (1ull << i))) continue;
+        struct attribute *t = attributes + i;
+        // the rest are still stepped over as a whole below
+        if (!t->size) break;
+        void *dest = (t->offset == NOWHERE) ? 0 : (void *)a + t->offset;
+        switch (t->size) {
+        case ATTR_OPAQUE:
+            s = skip_opaque(c, b);
+            break;
+        case ATTR_BITMAP:
+            s = parse_bitmap(c, b, 0);
+            break;
+        case 4: {
+            u32 v = read_beu32(c, b);
+            if (dest) *(u32 *)dest = v;
+            break;
+        }
+        case 8: {
+            u64 v = read_beu64(c, b);
+            if (dest) *(u64 *)dest = v;
+            break;
+        }
+        case 12: {
+            struct nfstime v;
+            v.seconds = read_beu64(c, b);
+            v.nseconds = read_beu32(c, b);
+            if (dest) *(struct nfstime *)dest = v;
+            break;
+        }
+        default:
+            s = read_buffer(c, b, 0, t->size);
+        }
+        if (!is_ok(s)) return s;
+        if (dest) a->mask |= 1ull << i;
+    }
+    if (b->start > end) return allocate_status(c, "encoding mismatch");
+    b->start = end;
+    return STATUS_OK;
+}
+
+// only the fixed size attributes we keep in a fattr can be sent
+void push_fattr(buffer b, fattr a)
+{
+    push_be32(b, 2);
+    push_be32(b, a->mask);
+    push_be32(b, a->mask >> 32);
+    bytes lenloc = b->end;
+    push_be32(b, 0);
+    for (int i = 0; i < 64; i++) {
+        if (!(a->mask & (1ull << i))) continue;
+        struct attribute *t = attributes + i;
+        void *src = (void *)a + t->offset;
+        switch (t->size) {
+        case 4:
+            push_be32(b, *(u32 *)src);
+            break;
+        case 8:
+            push_be64(b, *(u64 *)src);
+            break;
+        case 12:
+            push_be64(b, ((struct nfstime *)src)->seconds);
+            push_be32(b, ((struct nfstime *)src)->nseconds);
+            break;
+        }
+    }
+    *(u32 *)(b->contents + lenloc) = htonl(b->end - lenloc - 4);
+}
+
+void push_attr_request(rpc r, u64 mask)
+{
+    push_op(r, OP_GETATTR);
+    if (mask >> 32) {
+        push_be32(r->b, 2);
+        push_be32(r->b, mask);
+        push_be32(r->b, mask >> 32);
+    } else {
+        push_be32(r->b, 1);
+        push_be32(r->b, mask);
+    }
+}
+
 status parse_ace(client c, buffer b)
 {
     read_beu32(c, b); // type
     read_beu32(c, b); // flag
     read_beu32(c, b); // mask
-    u32 namelen = read_beu32(c, b); 
-    return read_buffer(c, b, 0, namelen);
+    return skip_opaque(c, b); // who
 }
 
-// directory has a stateid update in here
-status parse_open(file f, buffer b)
+// section 18.16.4, rfc 5661
+static status parse_delegation(client c, buffer b, stateid sid, u32 *type)
 {
-    struct stateid delegation_sid;
-
-    parse_stateid(f->c, b, &f->open_sid);
-    memcpy(&f->latest_sid, &f->open_sid, sizeof(struct stateid));
-    // change info
-    u32 atomic = read_beu32(f->c, b); // atomic
-    u64 before = read_beu64(f->c, b); // before
-    u64 after = read_beu64(f->c, b); // after
-    u32 rflags = read_beu32(f->c, b); // rflags
-    u32 bitmap_len = read_beu32(f->c, b); // bitmap4 attr
-    b->start += bitmap_len * sizeof(u32);
-    u32 delegation_type = read_beu32(f->c, b);
-
-    switch (delegation_type) {
+    status s = STATUS_OK;
+    *type = read_beu32(c, b);
+    switch (*type) {
     case OPEN_DELEGATE_NONE:
         break;
     case OPEN_DELEGATE_READ:
-        parse_stateid(f->c, b, &delegation_sid);
-        read_beu32(f->c, b); // recall
-        parse_ace(f->c, b);
+        parse_stateid(c, b, sid);
+        read_beu32(c, b); // recall
+        s = parse_ace(c, b);
         break;
     case OPEN_DELEGATE_WRITE:
-        parse_stateid(f->c, b, &delegation_sid);
-        read_beu32(f->c, b); // recall
-        u32 lt = read_beu32(f->c, b); // space limit - this is pretty ridiculous
-        switch (lt) {
-        case NFS_LIMIT_SIZE:
-            read_beu64(f->c, b); // space bytes
-        case NFS_LIMIT_BLOCKS:
-            read_beu32(f->c, b); // nblocks
-            read_beu64(f->c, b); // bytes per
-        default:
-            return allocate_status(f->c, "bad limit size");
-        }
-        parse_ace(f->c, b);
+        parse_stateid(c, b, sid);
+        read_beu32(c, b); // recall
+        // space limit - either a size or blocks and bytes per, 8 bytes each way
+        read_beu32(c, b);
+        read_beu64(c, b);
+        s = parse_ace(c, b);
         break;
     case OPEN_DELEGATE_NONE_EXT: /* New to NFSv4.1 */
-        {
-            u32 why = read_beu32(f->c, b);
-            switch (why) {
-            case WND4_CONTENTION:
-                read_beu32(f->c, b); // ond_server_will_push_deleg;
-            case WND4_RESOURCE:
-                read_beu32(f->c, b); // server_will_signal avail
-            }
+        *type = OPEN_DELEGATE_NONE;
+        switch (read_beu32(c, b)) {
+        case WND4_CONTENTION:
+        case WND4_RESOURCE:
+            read_beu32(c, b); // server will push or signal
         }
         break;
     default:
-        return allocate_status(f->c, "bad delegation return");
+        return allocate_status(c, "bad delegation return");
+    }
+    return s;
+}
+
+status skip_result(client c, buffer b, u32 op)
+{
+    if ((op > OP_CLONE) || !results[op][0])
+        return allocate_status(c, "unhandled scan code");
+    struct stateid sid;
+    status s = STATUS_OK;
+    for (u8 *f = results[op]; is_ok(s) && (*f != X_DONE); f++) {
+        switch (*f) {
+        case X_U32:
+            read_beu32(c, b);
+            break;
+        case X_U64:
+            read_beu64(c, b);
+            break;
+        case X_OPAQUE:
+            s = skip_opaque(c, b);
+            break;
+        case X_STATEID:
+            s = read_buffer(c, b, 0, sizeof(u32) + NFS4_OTHER_SIZE);
+            break;
+        case X_VERIFIER:
+            s = read_buffer(c, b, 0, NFS4_VERIFIER_SIZE);
+            break;
+        case X_SESSIONID:
+            s = read_buffer(c, b, 0, NFS4_SESSIONID_SIZE);
+            break;
+        case X_BITMAP:
+            s = parse_bitmap(c, b, 0);
+            break;
+        case X_FATTR: {
+            struct fattr a;
+            s = parse_fattr(c, b, &a);
+            break;
+        }
+        case X_CHANGE_INFO:
+            s = read_buffer(c, b, 0, 4 + 8 + 8);
+            break;
+        case X_DELEGATION: {
+            u32 type;
+            s = parse_delegation(c, b, &sid, &type);
+            break;
+        }
+        case X_U32_ARRAY:
+            s = read_buffer(c, b, 0, read_beu32(c, b) * 4);
+            break;
+        }
     }
+    return s;
+}
+
+// directory has a stateid update in here
+status parse_open(file f, buffer b)
+{
+    client c = f->c;
+
+    status s = parse_stateid(c, b, &f->open_sid);
+    if (!is_ok(s)) return s;
+    memcpy(&f->latest_sid, &f->open_sid, sizeof(struct stateid));
+    s = read_buffer(c, b, 0, 4 + 8 + 8); // change info
+    if (!is_ok(s)) return s;
+    read_beu32(c, b); // rflags
+    s = parse_bitmap(c, b, 0); // attrset
+    if (!is_ok(s)) return s;
+    s = parse_delegation(c, b, &f->delegation, &f->delegation_type);
+    f->delegation_epoch = c->delegation_epoch;
+    return s;
 }
 
 void push_open(rpc r, buffer name, u32 share_access, boolean create)
@@ -229,13 +533,9 @@ void push_open(rpc r, buffer name, u32 share_access, boolean create)
     if (create) {
         push_be32(r->b, OPEN4_CREATE);
         push_be32(r->b, UNCHECKED4);
-        // xxx - encode this properly, this is the fattr for
-        // the newly created file
-        push_be32(r->b, 0x00000002);
-        push_be32(r->b, 0x00000000);
-        push_be32(r->b, 0x00000002);
-        push_be32(r->b, 0x00000004);
-        push_be32(r->b, 0x000001a4);
+        // the attributes for the newly created file
+        struct fattr a = {.mask = 1ull<<FATTR4_MODE, .mode = 0644};
+        push_fattr(r->b, &a);
     } else {
         push_be32(r->b, OPEN4_NOCREATE);
     }